@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "preprocessor.h"
+#include "prefetch.h"
+#include "lexer.h"
+#include "parser.h"
+#include "translator.h"
+#include "intern.h"
+#include "fs.h"
+#include "walk.h"
+
+// Runs every front-end stage on its own over generated programs of a few
+// sizes: the preprocessor over the files, the lexer over the preprocessed
+// text, the parser over tokens lexed beforehand and the translator over the
+// finished tree. Prints one CSV row per stage and size, best of a few runs,
+// so the output can be diffed or plotted between builds. bytes is what the
+// stage reads, for the translator the assembly it writes.
+//
+// usage: frontend [megabytes]...
+
+static const size_t DEFAULT_BENCH_SIZES_MB[] = { 1, 2, 4 };
+static const int BENCH_REPEATS = 3;
+
+static const char* BENCH_HEADER =
+	"#define SCALE(x) ((x) * 3)\n"
+	"#define LIMIT 1000\n";
+
+static const char* BENCH_FUNCTION =
+	"var g%zu = SCALE(%zu) + 1;\n"
+	"func f%zu(a, b)\n"
+	"{\n"
+	"	var s = SCALE(a) * 31 + b / 7;\n"
+	"	while (s > LIMIT) { s = s - LIMIT; }\n"
+	"	if (s == 42) { s = 1; } else { s = s ^ 3 & 1 | 2; }\n"
+	"	f%zu(b, s);\n"
+	"	return s + g%zu;\n"
+	"}\n\n";
+
+typedef struct stage_result
+{
+	double seconds;
+	size_t bytes;
+	size_t tokens;
+	size_t nodes;
+} stage_result_t;
+
+static double now()
+{
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// f0 calls itself, every later function the one before it, there are no
+// forward references for the translator to reject
+static char* generate_source(size_t size)
+{
+	char* source = (char*)calloc(size + 1024, sizeof(char));
+	size_t len = (size_t)sprintf(source, "#include \"defs.ykk\"\n");
+
+	for (size_t i = 0; len < size; i++)
+		len += (size_t)sprintf(source + len, BENCH_FUNCTION, i, i, i, i ? i - 1 : 0, i);
+
+	sprintf(source + len, "func main()\n{\n\tf0(1, 2);\n\treturn 0;\n}\n");
+	return source;
+}
+
+static size_t count_nodes(const ast_t* ast)
+{
+	ast_walk_t walk;
+	size_t cnt = 0;
+
+	ast_walk_init(&walk, ast, ast->root);
+	while (ast_walk_next(&walk))
+		cnt += !ast_walk_top(&walk)->step;
+
+	ast_walk_free(&walk);
+	return cnt;
+}
+
+static void keep_best(stage_result_t* best, const stage_result_t* run, int repeat)
+{
+	if (!repeat || run->seconds < best->seconds)
+		*best = *run;
+}
+
+static int bench_preprocess(const char* dir, const char* path, size_t source_size, char** text, stage_result_t* best)
+{
+	for (int i = 0; i < BENCH_REPEATS; i++)
+	{
+		preprocessor_t pp = {0};
+		preprocessor_init(&pp, DEFAULT_PREFETCH_THREADS);
+		resolver_add_dir(&pp.resolver, dir);
+
+		free(*text);
+		*text = 0;
+
+		double start = now();
+		int status = preprocess(&pp, path, text);
+		stage_result_t run = { now() - start, source_size };
+
+		preprocessor_free(&pp);
+		if (status)
+			return status;
+
+		keep_best(best, &run, i);
+	}
+
+	return 0;
+}
+
+static void bench_lex(const char* text, stage_result_t* best)
+{
+	for (int i = 0; i < BENCH_REPEATS; i++)
+	{
+		token_text_t token_text = {0};
+		token_stream_t tokens = {0};
+		stage_result_t run = { 0, strlen(text) };
+
+		double start = now();
+		token_stream_open(&tokens, text, &token_text);
+		for (; token_kind(&tokens, 0) != TOKEN_EOF; token_advance(&tokens))
+			run.tokens++;
+		run.seconds = now() - start;
+
+		token_stream_close(&tokens);
+		token_text_free(&token_text);
+		keep_best(best, &run, i);
+	}
+}
+
+// The tokens are lexed up front, only the parser itself is timed
+static void bench_parse(const char* text, size_t token_cnt, ast_t* ast, stage_result_t* best)
+{
+	for (int i = 0; i < BENCH_REPEATS; i++)
+	{
+		token_text_t token_text = {0};
+		token_stream_t tokens = {0};
+		token_stream_open_parallel(&tokens, text, &token_text, 1);
+
+		ast_free(ast);
+		ast_init(ast);
+
+		double start = now();
+		parse_program(&tokens, &token_text, 0, ast);
+		double elapsed = now() - start;
+		stage_result_t run = { elapsed, strlen(text), token_cnt, count_nodes(ast) };
+
+		token_stream_close(&tokens);
+		token_text_free(&token_text);
+		keep_best(best, &run, i);
+	}
+}
+
+static void bench_translate(const ast_t* ast, size_t node_cnt, stage_result_t* best)
+{
+	for (int i = 0; i < BENCH_REPEATS; i++)
+	{
+		double start = now();
+		buf_writer_t asm_buf = translate(ast, 0);
+		stage_result_t run = { now() - start, 0, 0, node_cnt };
+
+		run.bytes = strlen(asm_buf.buf);
+		free(asm_buf.buf);
+		keep_best(best, &run, i);
+	}
+}
+
+static void print_result(const char* stage, size_t size_mb, const stage_result_t* result)
+{
+	printf("%s,%zu,%zu,%zu,%zu,%.6f,%.2f,%.0f,%.0f\n", stage, size_mb, result->bytes, result->tokens, result->nodes, result->seconds,
+		(double)result->bytes / (1 << 20) / result->seconds,
+		(double)result->tokens / result->seconds,
+		(double)result->nodes / result->seconds);
+}
+
+static int bench_size(const char* dir, size_t size_mb)
+{
+	char* path = 0;
+	char* source = generate_source(size_mb << 20);
+	char* text = 0;
+	stage_result_t preprocessed = {0}, lexed = {0}, parsed = {0}, translated = {0};
+
+	asprintf(&path, "%s/main.ykk", dir);
+	write_file(path, source, strlen(source));
+
+	int status = bench_preprocess(dir, path, strlen(source), &text, &preprocessed);
+	if (!status)
+	{
+		bench_lex(text, &lexed);
+		ast_t ast = {0};
+		bench_parse(text, lexed.tokens, &ast, &parsed);
+		bench_translate(&ast, parsed.nodes, &translated);
+		ast_free(&ast);
+
+		print_result("preprocess", size_mb, &preprocessed);
+		print_result("lex", size_mb, &lexed);
+		print_result("parse", size_mb, &parsed);
+		print_result("translate", size_mb, &translated);
+		fflush(stdout);
+	}
+
+	unlink(path);
+	free(text);
+	free(source);
+	free(path);
+	return status;
+}
+
+int main(int argc, char** argv)
+{
+	char dir[] = "/tmp/ykk-bench-XXXXXX";
+	char* defs_path = 0;
+	int status = 0;
+
+	if (!mkdtemp(dir))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	asprintf(&defs_path, "%s/defs.ykk", dir);
+	write_file(defs_path, (char*)BENCH_HEADER, strlen(BENCH_HEADER));
+
+	printf("stage,size_mb,bytes,tokens,nodes,seconds,mb_per_s,tokens_per_s,nodes_per_s\n");
+
+	if (argc > 1)
+	{
+		for (int i = 1; i < argc && !status; i++)
+			status = bench_size(dir, strtoul(argv[i], 0, 10));
+	}
+	else
+	{
+		for (size_t i = 0; i < sizeof(DEFAULT_BENCH_SIZES_MB) / sizeof(DEFAULT_BENCH_SIZES_MB[0]) && !status; i++)
+			status = bench_size(dir, DEFAULT_BENCH_SIZES_MB[i]);
+	}
+
+	unlink(defs_path);
+	rmdir(dir);
+	free(defs_path);
+	interner_free();
+	return status;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lexer.h"
+#include "intern.h"
+
+// Lexes a generated multi-megabyte program with lex_parallel() on 1, 2, 4...
+// threads up to the core count, checks every result against the sequential
+// one and prints the throughput.
+//
+// usage: lex_scaling [megabytes] [max threads]
+
+static const size_t DEFAULT_BENCH_SIZE_MB = 64;
+static const int BENCH_REPEATS = 3;
+
+static const char* BENCH_FUNCTION =
+	"func f%zu(a, b)\n"
+	"{\n"
+	"	var sum = a * 31 + b / 7;\n"
+	"	while (sum > 1000) { sum = sum - 1000; }\n"
+	"	if (sum == 42) { out(sum); } else { out(a ^ b & 255 | 1); }\n"
+	"	return sum + f%zu(b, 12345);\n"
+	"}\n\n";
+
+static char* generate_source(size_t size)
+{
+	char* source = (char*)calloc(size + 512, sizeof(char));
+	size_t len = 0;
+
+	for (size_t i = 0; len < size; i++)
+		len += (size_t)sprintf(source + len, BENCH_FUNCTION, i, i + 1);
+
+	return source;
+}
+
+// Powers of two, then the core count itself
+static long next_thread_cnt(long threads, long max_threads)
+{
+	if (threads < max_threads && threads * 2 > max_threads)
+		return max_threads;
+
+	return threads * 2;
+}
+
+static double now()
+{
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int same_tokens(const token_array_t* a, const token_array_t* b)
+{
+	if (a->token_cnt != b->token_cnt)
+		return 0;
+
+	return !memcmp(a->kinds, b->kinds, a->token_cnt * sizeof(token_type_t))
+		&& !memcmp(a->values, b->values, a->token_cnt * sizeof(token_value_t))
+		&& !memcmp(a->offsets, b->offsets, a->token_cnt * sizeof(uint32_t));
+}
+
+int main(int argc, char** argv)
+{
+	size_t size_mb = argc > 1 ? strtoul(argv[1], 0, 10) : DEFAULT_BENCH_SIZE_MB;
+	long max_threads = argc > 2 ? strtol(argv[2], 0, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads < 1)
+		max_threads = 1;
+
+	char* source = generate_source(size_mb << 20);
+	size_t length = strlen(source);
+
+	token_array_t expected = {0};
+	token_array_init(&expected, true);
+	lex_parallel(source, 1, &expected);
+
+	printf("%zu bytes, %zu tokens\n", length, expected.token_cnt);
+	printf("%8s %10s %10s %8s\n", "threads", "ms", "MB/s", "speedup");
+
+	double sequential = 0;
+	for (long threads = 1; threads <= max_threads; threads = next_thread_cnt(threads, max_threads))
+	{
+		double best = 0;
+		for (int i = 0; i < BENCH_REPEATS; i++)
+		{
+			token_array_t tokens = {0};
+			token_array_init(&tokens, true);
+
+			double start = now();
+			lex_parallel(source, (size_t)threads, &tokens);
+			double elapsed = now() - start;
+
+			if (!same_tokens(&tokens, &expected))
+			{
+				fprintf(stderr, "%ld threads: tokens differ from the sequential lex\n", threads);
+				return 1;
+			}
+
+			token_array_free(&tokens);
+			if (!i || elapsed < best)
+				best = elapsed;
+		}
+
+		if (threads == 1)
+			sequential = best;
+
+		printf("%8ld %10.1f %10.1f %7.2fx\n", threads, best * 1e3, (double)length / (1 << 20) / best, sequential / best);
+	}
+
+	token_array_free(&expected);
+	free(source);
+	interner_free();
+	return 0;
+}
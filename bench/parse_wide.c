@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lexer.h"
+#include "parser.h"
+#include "intern.h"
+
+// Parses programs made of one very wide construct each: a top level with n
+// declarations, one block with n statements, a function with n parameters
+// and a call with n arguments. The time per child should stay flat as n
+// grows, anything that copies the child list per append shows up as a
+// climbing ns/child column.
+//
+// usage: parse_wide [children]...
+
+static const size_t DEFAULT_WIDTHS[] = { 10000, 100000, 1000000 };
+static const int BENCH_REPEATS = 3;
+
+typedef enum WIDE_SHAPE
+{
+	WIDE_PROGRAM,
+	WIDE_BLOCK,
+	WIDE_PARAMETERS,
+	WIDE_ARGUMENTS,
+	WIDE_SHAPE_CNT
+} wide_shape_t;
+
+static const char* SHAPE_NAMES[WIDE_SHAPE_CNT] = { "program", "block", "parameters", "arguments" };
+
+static double now()
+{
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static char* generate_source(wide_shape_t shape, size_t width)
+{
+	char* source = (char*)calloc(width * 32 + 256, sizeof(char));
+	size_t len = 0;
+
+	switch (shape)
+	{
+		case WIDE_PROGRAM:
+			for (size_t i = 0; i < width; i++)
+				len += (size_t)sprintf(source + len, "var v%zu = %zu;\n", i, i);
+			break;
+		case WIDE_BLOCK:
+			len += (size_t)sprintf(source + len, "func main()\n{\n\tvar x = 0;\n");
+			for (size_t i = 1; i < width; i++)
+				len += (size_t)sprintf(source + len, "\tx = x + %zu;\n", i);
+			sprintf(source + len, "}\n");
+			break;
+		case WIDE_PARAMETERS:
+			len += (size_t)sprintf(source + len, "func f(p0");
+			for (size_t i = 1; i < width; i++)
+				len += (size_t)sprintf(source + len, ", p%zu", i);
+			sprintf(source + len, ")\n{\n\treturn p0;\n}\n");
+			break;
+		case WIDE_ARGUMENTS:
+			len += (size_t)sprintf(source + len, "func main()\n{\n\tf(0");
+			for (size_t i = 1; i < width; i++)
+				len += (size_t)sprintf(source + len, ", %zu", i);
+			sprintf(source + len, ");\n}\n");
+			break;
+		default:
+			break;
+	}
+
+	return source;
+}
+
+static size_t wide_child_count(const ast_t* ast, wide_shape_t shape)
+{
+	ast_list_t top = ast_node(ast, ast->root)->data.block.children;
+	const ast_node_t* function = ast_list_cnt(ast, top) ? ast_node(ast, ast_list_items(ast, top)[0]) : 0;
+	const ast_node_t* body = function ? ast_node(ast, function->data.function.body) : 0;
+
+	switch (shape)
+	{
+		case WIDE_PROGRAM:
+			return ast_list_cnt(ast, top);
+		case WIDE_BLOCK:
+			return ast_list_cnt(ast, body->data.block.children);
+		case WIDE_PARAMETERS:
+			return ast_list_cnt(ast, function->data.function.parameters);
+		case WIDE_ARGUMENTS:
+			return ast_list_cnt(ast, ast_node(ast, ast_list_items(ast, body->data.block.children)[0])->data.function_call.arguments);
+		default:
+			return 0;
+	}
+}
+
+// The tokens are lexed up front, only the parser is timed
+static int bench_shape(wide_shape_t shape, size_t width)
+{
+	char* source = generate_source(shape, width);
+	double best = 0;
+	int status = 0;
+
+	for (int i = 0; i < BENCH_REPEATS && !status; i++)
+	{
+		token_text_t token_text = {0};
+		token_stream_t tokens = {0};
+		ast_t ast = {0};
+		ast_init(&ast);
+		token_stream_open_parallel(&tokens, source, &token_text, 1);
+
+		double start = now();
+		parse_program(&tokens, &token_text, 0, &ast);
+		double elapsed = now() - start;
+
+		if (wide_child_count(&ast, shape) != width)
+		{
+			fprintf(stderr, "%s %zu: parsed %zu children\n", SHAPE_NAMES[shape], width, wide_child_count(&ast, shape));
+			status = 1;
+		}
+
+		ast_free(&ast);
+		token_stream_close(&tokens);
+		token_text_free(&token_text);
+		if (!i || elapsed < best)
+			best = elapsed;
+	}
+
+	if (!status)
+		printf("%-12s %10zu %10.2f %10.1f\n", SHAPE_NAMES[shape], width, best * 1e3, best * 1e9 / (double)width);
+
+	free(source);
+	return status;
+}
+
+static int bench_width(size_t width)
+{
+	int status = 0;
+	for (int shape = 0; shape < WIDE_SHAPE_CNT && !status; shape++)
+		status = bench_shape((wide_shape_t)shape, width);
+
+	return status;
+}
+
+int main(int argc, char** argv)
+{
+	int status = 0;
+
+	printf("%-12s %10s %10s %10s\n", "shape", "children", "ms", "ns/child");
+
+	if (argc > 1)
+	{
+		for (int i = 1; i < argc && !status; i++)
+			status = bench_width(strtoul(argv[i], 0, 10));
+	}
+	else
+	{
+		for (size_t i = 0; i < sizeof(DEFAULT_WIDTHS) / sizeof(DEFAULT_WIDTHS[0]) && !status; i++)
+			status = bench_width(DEFAULT_WIDTHS[i]);
+	}
+
+	interner_free();
+	return status;
+}
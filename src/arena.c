@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+static size_t align_size(size_t size)
+{
+	return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+// Fresh blocks come from calloc, so every allocation starts out zeroed
+static void add_block(arena_t* arena, size_t size)
+{
+	size_t data_size = size > DEFAULT_ARENA_BLOCK_SIZE ? size : DEFAULT_ARENA_BLOCK_SIZE;
+	arena_block_t* block = (arena_block_t*)calloc(1, sizeof(arena_block_t) + data_size);
+
+	block->next = arena->blocks;
+	block->size = data_size;
+	arena->blocks = block;
+	arena->cursor = (char*)(block + 1);
+	arena->end = arena->cursor + data_size;
+}
+
+void* arena_alloc(arena_t* arena, size_t size)
+{
+	size = align_size(size);
+	if ((size_t)(arena->end - arena->cursor) < size)
+		add_block(arena, size);
+
+	void* ptr = arena->cursor;
+	arena->cursor += size;
+	return ptr;
+}
+
+// The newest allocation grows in place while its block has room, anything
+// else is copied and the old space is left behind
+void* arena_grow(arena_t* arena, void* ptr, size_t old_size, size_t new_size)
+{
+	char* start = (char*)ptr;
+	if (start && start + align_size(old_size) == arena->cursor && (size_t)(arena->end - start) >= align_size(new_size))
+	{
+		arena->cursor = start + align_size(new_size);
+		return ptr;
+	}
+
+	void* grown = arena_alloc(arena, new_size);
+	if (old_size)
+		memcpy(grown, ptr, old_size);
+	return grown;
+}
+
+char* arena_strndup(arena_t* arena, const char* string, size_t len)
+{
+	char* copy = (char*)arena_alloc(arena, len + 1);
+	memcpy(copy, string, len);
+	return copy;
+}
+
+void arena_free(arena_t* arena)
+{
+	while (arena->blocks)
+	{
+		arena_block_t* next = arena->blocks->next;
+		free(arena->blocks);
+		arena->blocks = next;
+	}
+
+	*arena = (arena_t){0};
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdlib.h>
+
+static const size_t DEFAULT_ARENA_BLOCK_SIZE = 64 * 1024;
+
+#define ARENA_ALIGNMENT 16
+
+// Bump allocator for data that dies all at once. Allocations are zeroed
+// and aligned to ARENA_ALIGNMENT, nothing is freed on its own: arena_free()
+// drops the blocks wholesale.
+typedef struct arena_block
+{
+	struct arena_block* next;
+	size_t size;
+} arena_block_t;
+
+typedef struct arena
+{
+	arena_block_t* blocks;	// newest first, the cursor is in the first one
+	char* cursor;
+	char* end;
+} arena_t;
+
+void* arena_alloc(arena_t* arena, size_t size);
+void* arena_grow(arena_t* arena, void* ptr, size_t old_size, size_t new_size);
+char* arena_strndup(arena_t* arena, const char* string, size_t len);
+void arena_free(arena_t* arena);
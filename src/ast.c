@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+
+// Doubles the array until needed more items fit behind the used ones
+static void* reserve(void* items, size_t* allocated, size_t used, size_t needed, size_t item_size, size_t initial)
+{
+	if (used + needed <= *allocated)
+		return items;
+
+	if (!*allocated)
+		*allocated = initial;
+	while (*allocated < used + needed)
+		*allocated *= 2;
+
+	return realloc(items, *allocated * item_size);
+}
+
+// Index 0 of the nodes is the missing node, offset 0 of the lists the
+// empty list
+void ast_init(ast_t* ast)
+{
+	*ast = (ast_t){0};
+	ast_add_node(ast, (ast_node_t){ .type = AST_NONE });
+	ast_add_list(ast, 0, 0);
+}
+
+void ast_free(ast_t* ast)
+{
+	free(ast->nodes);
+	free(ast->lists);
+	free(ast->numbers);
+	free(ast->asm_texts);
+	arena_free(&ast->text);
+	*ast = (ast_t){0};
+}
+
+ast_index_t ast_add_node(ast_t* ast, ast_node_t node)
+{
+	ast->nodes = (ast_node_t*)reserve(ast->nodes, &ast->nodes_allocated, ast->node_cnt, 1, sizeof(ast_node_t), DEFAULT_AST_NODES_ALLOC);
+	ast->nodes[ast->node_cnt] = node;
+	return (ast_index_t)ast->node_cnt++;
+}
+
+ast_list_t ast_add_list(ast_t* ast, const ast_index_t* children, size_t count)
+{
+	if (!count && ast->list_cnt)
+		return 0;
+
+	ast->lists = (ast_index_t*)reserve(ast->lists, &ast->lists_allocated, ast->list_cnt, count + 1, sizeof(ast_index_t), DEFAULT_AST_LISTS_ALLOC);
+
+	ast_list_t list = (ast_list_t)ast->list_cnt;
+	ast->lists[list] = (ast_index_t)count;
+	if (count)
+		memcpy(&ast->lists[list + 1], children, count * sizeof(ast_index_t));
+
+	ast->list_cnt += count + 1;
+	return list;
+}
+
+uint32_t ast_add_number(ast_t* ast, number_t number)
+{
+	ast->numbers = (number_t*)reserve(ast->numbers, &ast->numbers_allocated, ast->number_cnt, 1, sizeof(number_t), DEFAULT_AST_VALUES_ALLOC);
+	ast->numbers[ast->number_cnt] = number;
+	return (uint32_t)ast->number_cnt++;
+}
+
+uint32_t ast_add_asm(ast_t* ast, const char* text, size_t len)
+{
+	ast->asm_texts = (const char**)reserve(ast->asm_texts, &ast->asm_texts_allocated, ast->asm_text_cnt, 1, sizeof(char*), DEFAULT_AST_VALUES_ALLOC);
+	ast->asm_texts[ast->asm_text_cnt] = arena_strndup(&ast->text, text, len);
+	return (uint32_t)ast->asm_text_cnt++;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "lexer.h"
+#include "intern.h"
+#include "arena.h"
+
+static const size_t DEFAULT_AST_NODES_ALLOC = 1024;
+static const size_t DEFAULT_AST_LISTS_ALLOC = 1024;
+static const size_t DEFAULT_AST_VALUES_ALLOC = 64;
+
+typedef enum AST_NODE_TYPE {
+    AST_NONE,               // index 0, stands for a missing child
+    AST_NUMBER,
+    AST_IDENTIFIER,
+    AST_ASSIGNMENT,
+    AST_DECLARATION,
+    AST_FUNCTION,
+    AST_IF,
+    AST_WHILE,
+    AST_BLOCK,
+    AST_PROGRAM,
+    AST_BINARY,
+    AST_FUNCTION_CALL,
+    AST_INLINE_ASM,
+    AST_RETURN,
+    AST_IMPORT,
+} ast_node_type_t;
+
+// Nodes live in one array and point at each other by index, 0 meaning
+// none. Names are interned symbols, not nodes of their own. Child lists of
+// any length are offsets into the side array of lists, where each one is
+// its length followed by the children. Numbers and inline asm, the only
+// payloads that do not fit 32 bits, sit in side arrays as well.
+typedef uint32_t ast_index_t;
+typedef uint32_t ast_list_t;
+
+typedef struct ast_node {
+    uint8_t type;                   // ast_node_type_t
+    uint8_t op;                     // binary: token_type_t of the operator
+    union {
+        uint32_t value;             // numbers and inline asm: index into the side array
+        symbol_t symbol;            // identifiers and import names
+        struct {
+            symbol_t name;
+            ast_index_t value;
+        } assignment;
+        struct {
+            symbol_t name;
+            ast_index_t initializer;
+        } declaration;
+        struct {
+            ast_index_t condition;
+            ast_index_t then_branch;
+            ast_index_t else_branch;
+        } if_statement;
+        struct {
+            ast_index_t condition;
+            ast_index_t body;
+        } while_statement;
+        struct {
+            symbol_t name;
+            ast_list_t parameters;  // identifiers
+            ast_index_t body;
+        } function;
+        struct {
+            ast_list_t children;
+        } block;                    // also the program
+        struct {
+            ast_index_t left;
+            ast_index_t right;
+        } binary_op;
+        struct {
+            symbol_t name;
+            ast_list_t arguments;
+        } function_call;
+        struct {
+            ast_index_t value;
+        } return_statement;
+    } data;
+} ast_node_t;
+
+typedef struct ast {
+    ast_node_t* nodes;
+    size_t node_cnt;
+    size_t nodes_allocated;
+
+    ast_index_t* lists;
+    size_t list_cnt;
+    size_t lists_allocated;
+
+    number_t* numbers;
+    size_t number_cnt;
+    size_t numbers_allocated;
+
+    const char** asm_texts;
+    size_t asm_text_cnt;
+    size_t asm_texts_allocated;
+    arena_t text;                   // where the asm strings are kept
+
+    ast_index_t root;
+} ast_t;
+
+void ast_init(ast_t* ast);
+void ast_free(ast_t* ast);
+
+ast_index_t ast_add_node(ast_t* ast, ast_node_t node);
+ast_list_t ast_add_list(ast_t* ast, const ast_index_t* children, size_t count);
+uint32_t ast_add_number(ast_t* ast, number_t number);
+uint32_t ast_add_asm(ast_t* ast, const char* text, size_t len);
+
+// Only valid while no nodes are added, the array moves as it grows
+static inline const ast_node_t* ast_node(const ast_t* ast, ast_index_t index)
+{
+    return &ast->nodes[index];
+}
+
+static inline size_t ast_list_cnt(const ast_t* ast, ast_list_t list)
+{
+    return ast->lists[list];
+}
+
+static inline const ast_index_t* ast_list_items(const ast_t* ast, ast_list_t list)
+{
+    return &ast->lists[list + 1];
+}
+
+static inline number_t ast_number(const ast_t* ast, const ast_node_t* node)
+{
+    return ast->numbers[node->data.value];
+}
+
+static inline const char* ast_asm_text(const ast_t* ast, const ast_node_t* node)
+{
+    return ast->asm_texts[node->data.value];
+}
@@ -18,15 +18,19 @@ static void bufindent(buf_writer_t* writer)
 		bufcpy(writer, "\t");
 }
 
-void bufcpy(buf_writer_t* writer, const char* string)
+void bufslice(buf_writer_t* writer, const char* start, size_t len)
 {
-	size_t len = strlen(string);
 	ensure_allocated(writer, len);
 
-	memcpy(writer->buf + writer->cursor, string, len);
+	memcpy(writer->buf + writer->cursor, start, len);
 	writer->cursor += len;
 }
 
+void bufcpy(buf_writer_t* writer, const char* string)
+{
+	bufslice(writer, string, strlen(string));
+}
+
 void bufncpy(buf_writer_t* writer, const char* string)
 {
 	bufcpy(writer, string);
@@ -38,3 +42,11 @@ void bufend(buf_writer_t* writer)
 	writer->buf = (char*)realloc(writer->buf, (writer->cursor + 1) * sizeof(char));
 	writer->buf[writer->cursor] = '\x00';
 }
+
+void bufrepeat(buf_writer_t* writer, size_t start, size_t len)
+{
+	ensure_allocated(writer, len);
+
+	memcpy(writer->buf + writer->cursor, writer->buf + start, len);
+	writer->cursor += len;
+}
@@ -11,5 +11,7 @@ typedef struct buf_writer
 } buf_writer_t;
 
 void bufcpy(buf_writer_t* writer, const char* string);
+void bufslice(buf_writer_t* writer, const char* start, size_t len);
 void bufncpy(buf_writer_t* writer, const char* string);
 void bufend(buf_writer_t* writer);
+void bufrepeat(buf_writer_t* writer, size_t start, size_t len);
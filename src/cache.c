@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash.h"
+#include "fs.h"
+#include "io.h"
+#include "preprocessor.h"
+#include "depfile.h"
+#include "srcmap.h"
+
+// A dependency is either a file the text was read from or, when absent is
+// set, an include candidate that was searched before the file that was
+// found and has to stay missing
+typedef struct cache_dep
+{
+	bool absent;
+	size_t size;
+	struct timespec mtime;
+	uint64_t hash;
+	const char* path;
+} cache_dep_t;
+
+static const size_t DEFAULT_CACHE_DEPS_ALLOC = 16;
+
+static char* entry_path(const preprocess_cache_t* cache, const char* ext)
+{
+	char* path = 0;
+	asprintf(&path, "%s/%016lx.%s", cache->dir, cache->key, ext);
+	return path;
+}
+
+static int hash_file(const char* path, uint64_t* hash)
+{
+	mapped_file_t file = {0};
+	if (map_file(path, &file))
+		return 1;
+
+	*hash = hash_bytes(file.data, file.size, HASH_SEED);
+	unmap_file(&file);
+
+	return 0;
+}
+
+// entries are written next to their final name and renamed in place, so
+// a concurrent compile never observes a half written file
+static int write_entry(const char* path, const char* content, size_t size)
+{
+	char* tmp_path = 0;
+	asprintf(&tmp_path, "%s.%d.tmp", path, getpid());
+
+	int status = write_file(tmp_path, (char*)content, size);
+	if (!status && rename(tmp_path, path))
+		status = -1;
+
+	if (status)
+		unlink(tmp_path);
+
+	free(tmp_path);
+	return status;
+}
+
+static int write_manifest(const preprocess_cache_t* cache, const cache_dep_t* deps, size_t dep_cnt)
+{
+	buf_writer_t writer = { .buf = (char*)calloc(DEFAULT_PREPROCESSOR_ALLOC, sizeof(char)), .buf_len = DEFAULT_PREPROCESSOR_ALLOC };
+
+	bufncpy(&writer, CACHE_MANIFEST_MAGIC);
+	for (size_t i = 0; i < dep_cnt; i++)
+	{
+		char* line = 0;
+		if (deps[i].absent)
+			asprintf(&line, "- %s", deps[i].path);
+		else
+			asprintf(&line, "%zu %ld %ld %016lx %s", deps[i].size, deps[i].mtime.tv_sec, deps[i].mtime.tv_nsec, deps[i].hash, deps[i].path);
+		bufncpy(&writer, line);
+		free(line);
+	}
+
+	char* manifest_path = entry_path(cache, "deps");
+	int status = write_entry(manifest_path, writer.buf, writer.cursor);
+
+	free(manifest_path);
+	free(writer.buf);
+	return status;
+}
+
+static int write_srcmap(const preprocess_cache_t* cache, const srcmap_t* map)
+{
+	buf_writer_t writer = { .buf = (char*)calloc(DEFAULT_PREPROCESSOR_ALLOC, sizeof(char)), .buf_len = DEFAULT_PREPROCESSOR_ALLOC };
+	srcmap_serialize(map, &writer);
+
+	char* map_path = entry_path(cache, "map");
+	int status = write_entry(map_path, writer.buf, writer.cursor);
+
+	free(map_path);
+	free(writer.buf);
+	return status;
+}
+
+// Parses the manifest in place, returns the number of dependencies or -1
+static ssize_t parse_manifest(char* manifest, cache_dep_t** deps)
+{
+	size_t allocated = DEFAULT_CACHE_DEPS_ALLOC, dep_cnt = 0;
+	*deps = (cache_dep_t*)calloc(allocated, sizeof(cache_dep_t));
+
+	char* saveptr = 0;
+	char* line = strtok_r(manifest, "\n", &saveptr);
+	if (!line || strcmp(line, CACHE_MANIFEST_MAGIC) != 0)
+		return -1;
+
+	while ((line = strtok_r(0, "\n", &saveptr)))
+	{
+		cache_dep_t dep = {0};
+		int path_offset = 0;
+
+		if (line[0] == '-' && line[1] == ' ')
+		{
+			dep.absent = true;
+			path_offset = 2;
+		}
+		else if (sscanf(line, "%zu %ld %ld %lx %n", &dep.size, &dep.mtime.tv_sec, &dep.mtime.tv_nsec, &dep.hash, &path_offset) != 4 || !path_offset)
+			return -1;
+
+		dep.path = line + path_offset;
+
+		if (dep_cnt + 1 >= allocated)
+		{
+			allocated *= 2;
+			*deps = (cache_dep_t*)realloc(*deps, allocated * sizeof(cache_dep_t));
+		}
+		(*deps)[dep_cnt++] = dep;
+	}
+
+	return dep_cnt;
+}
+
+// Cheap size/mtime checks first, content is only hashed when the
+// timestamps moved. Sets *refresh when the stored timestamps are stale.
+static bool deps_valid(cache_dep_t* deps, size_t dep_cnt, bool* refresh)
+{
+	for (size_t i = 0; i < dep_cnt; i++)
+	{
+		struct stat st = {0};
+		if (deps[i].absent)
+		{
+			// the resolver would now stop at this candidate
+			if (!stat(deps[i].path, &st))
+				return false;
+			continue;
+		}
+
+		if (stat(deps[i].path, &st) || (size_t)st.st_size != deps[i].size)
+			return false;
+
+		if (st.st_mtim.tv_sec == deps[i].mtime.tv_sec && st.st_mtim.tv_nsec == deps[i].mtime.tv_nsec)
+			continue;
+
+		uint64_t hash = 0;
+		if (hash_file(deps[i].path, &hash) || hash != deps[i].hash)
+			return false;
+
+		deps[i].mtime = st.st_mtim;
+		*refresh = true;
+	}
+
+	return true;
+}
+
+void cache_init(preprocess_cache_t* cache, const char* dir)
+{
+	*cache = (preprocess_cache_t){ .dir = strdup(dir), .key = HASH_SEED };
+}
+
+void cache_key_add(preprocess_cache_t* cache, const char* part)
+{
+	cache->key = hash_str(part, cache->key);
+}
+
+// Entries written with a source map carry it in <key>.map
+static int read_srcmap(const preprocess_cache_t* cache, srcmap_t* map)
+{
+	char* map_path = entry_path(cache, "map");
+	char* content = 0;
+	int status = 1;
+
+	if (read_file(map_path, &content))
+		status = srcmap_parse(map, content);
+
+	// the preprocessor starts over on the same map
+	if (status)
+	{
+		srcmap_free(map);
+		srcmap_init(map);
+	}
+
+	free(content);
+	free(map_path);
+	return status;
+}
+
+// On a hit the manifest doubles as the dependency list, deps and map may be NULL
+int cache_lookup(preprocess_cache_t* cache, mapped_file_t* text, dep_list_t* deps_out, srcmap_t* map)
+{
+	char* manifest_path = entry_path(cache, "deps");
+	char* manifest = 0;
+	cache_dep_t* deps = 0;
+	bool refresh = false;
+	int status = 1;
+
+	if (!read_file(manifest_path, &manifest))
+		goto exit;
+
+	ssize_t dep_cnt = parse_manifest(manifest, &deps);
+	if (dep_cnt <= 0 || !deps_valid(deps, dep_cnt, &refresh))
+		goto exit;
+
+	char* text_path = entry_path(cache, "pp");
+	status = map_file(text_path, text);
+	free(text_path);
+
+	// the stored text carries its terminator, the lexer can run on the mapping
+	if (!status && (!text->size || text->data[text->size - 1] != '\0'))
+	{
+		unmap_file(text);
+		status = 1;
+	}
+
+	if (!status && map && read_srcmap(cache, map))
+	{
+		unmap_file(text);
+		status = 1;
+	}
+
+	if (!status && refresh)
+		write_manifest(cache, deps, dep_cnt);
+
+	for (ssize_t i = 0; !status && deps_out && i < dep_cnt; i++)
+	{
+		if (!deps[i].absent)
+			dep_list_add(deps_out, deps[i].path);
+	}
+
+exit:
+	free(deps);
+	free(manifest);
+	free(manifest_path);
+	return status;
+}
+
+int cache_store(preprocess_cache_t* cache, const preprocessor_t* pp, const char* text, size_t len)
+{
+	if (mkdir(cache->dir, 0755) && errno != EEXIST)
+	{
+		print_error("Could not create preprocessor cache directory");
+		return 1;
+	}
+
+	// prefetch workers may still be resolving includes nobody asked for
+	pthread_mutex_t* resolver_lock = (pthread_mutex_t*)&pp->resolver.lock;
+	pthread_mutex_lock(resolver_lock);
+
+	const hashtable_t* resolved = &pp->resolver.resolved;
+	size_t probed_cnt = 0;
+	for (size_t i = 0; i < resolved->capacity; i++)
+	{
+		const resolved_include_t* include = (const resolved_include_t*)resolved->entries[i].value;
+		if (include && include->path)
+			probed_cnt += include->probed_cnt;
+	}
+
+	cache_dep_t* deps = (cache_dep_t*)calloc(pp->file_cnt + probed_cnt + 1, sizeof(cache_dep_t));
+	size_t dep_cnt = 0;
+	int status = 0;
+
+	// an entry missing one of its files could be reused after that file
+	// changed, better to store nothing
+	for (size_t i = 0; i < pp->file_cnt; i++)
+	{
+		const included_file_t* file = &pp->files[i];
+		char* path = realpath(file->path, 0);
+		if (!path)
+		{
+			print_error("Could not resolve an included file, the preprocessor cache entry is not stored");
+			status = 1;
+			break;
+		}
+
+		deps[dep_cnt++] = (cache_dep_t){
+			.size = file->source.size,
+			.mtime = file->mtime,
+			.hash = hash_bytes(file->source.data, file->source.size, HASH_SEED),
+			.path = path,
+		};
+	}
+
+	// only includes that were found matter, a miss stops the compile; the
+	// cwd and search directories are part of the key, relative paths hold
+	for (size_t i = 0; i < resolved->capacity && !status; i++)
+	{
+		const resolved_include_t* include = (const resolved_include_t*)resolved->entries[i].value;
+		for (size_t j = 0; include && include->path && j < include->probed_cnt; j++)
+			deps[dep_cnt++] = (cache_dep_t){ .absent = true, .path = strdup(include->probed[j]) };
+	}
+
+	pthread_mutex_unlock(resolver_lock);
+
+	// the text goes first, a manifest is only ever visible next to its text
+	char* text_path = entry_path(cache, "pp");
+	if (!status)
+		status = write_entry(text_path, text, len + 1);
+	if (!status && pp->srcmap)
+		status = write_srcmap(cache, pp->srcmap);
+	if (!status)
+		status = write_manifest(cache, deps, dep_cnt);
+
+	for (size_t i = 0; i < dep_cnt; i++)
+		free((char*)deps[i].path);
+
+	free(deps);
+	free(text_path);
+	return status;
+}
+
+void cache_free(preprocess_cache_t* cache)
+{
+	free(cache->dir);
+	*cache = (preprocess_cache_t){0};
+}
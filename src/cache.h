@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fs.h"
+#include "preprocessor.h"
+#include "depfile.h"
+#include "srcmap.h"
+
+static const char* CACHE_MANIFEST_MAGIC = "ykkpp 2";
+
+typedef struct preprocess_cache
+{
+	char* dir;
+	uint64_t key;
+} preprocess_cache_t;
+
+void cache_init(preprocess_cache_t* cache, const char* dir);
+void cache_key_add(preprocess_cache_t* cache, const char* part);
+int cache_lookup(preprocess_cache_t* cache, mapped_file_t* text, dep_list_t* deps, srcmap_t* map);
+int cache_store(preprocess_cache_t* cache, const preprocessor_t* pp, const char* text, size_t len);
+void cache_free(preprocess_cache_t* cache);
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "depfile.h"
+#include "buffer.h"
+#include "fs.h"
+
+void dep_list_init(dep_list_t* deps)
+{
+	*deps = (dep_list_t){ .paths = (char**)calloc(DEFAULT_DEP_LIST_ALLOC, sizeof(char*)), .paths_allocated = DEFAULT_DEP_LIST_ALLOC };
+}
+
+void dep_list_add(dep_list_t* deps, const char* path)
+{
+	if (deps->path_cnt + 1 >= deps->paths_allocated)
+	{
+		deps->paths_allocated *= 2;
+		deps->paths = (char**)realloc(deps->paths, deps->paths_allocated * sizeof(char*));
+	}
+
+	deps->paths[deps->path_cnt++] = strdup(path);
+}
+
+void dep_list_free(dep_list_t* deps)
+{
+	for (size_t i = 0; i < deps->path_cnt; i++)
+		free(deps->paths[i]);
+
+	free(deps->paths);
+	*deps = (dep_list_t){0};
+}
+
+// make splits prerequisites on blanks and treats $ and # specially
+static void write_escaped(buf_writer_t* writer, const char* path)
+{
+	const char* start = path;
+
+	for (const char* c = path; *c; c++)
+	{
+		if (*c != ' ' && *c != '\t' && *c != '#' && *c != '$')
+			continue;
+
+		bufslice(writer, start, c - start);
+		bufcpy(writer, *c == '$' ? "$" : "\\");
+		start = c;
+	}
+
+	bufcpy(writer, start);
+}
+
+// Writes "target: deps..." followed by an empty rule per included file,
+// so make does not fail once a header is deleted from the tree
+int write_depfile(const char* depfile_path, const char* target, const dep_list_t* deps)
+{
+	buf_writer_t writer = { .buf = (char*)calloc(DEFAULT_DEP_LIST_ALLOC, sizeof(char)), .buf_len = DEFAULT_DEP_LIST_ALLOC };
+
+	write_escaped(&writer, target);
+	bufcpy(&writer, ":");
+	for (size_t i = 0; i < deps->path_cnt; i++)
+	{
+		bufcpy(&writer, " \\\n  ");
+		write_escaped(&writer, deps->paths[i]);
+	}
+	bufcpy(&writer, "\n");
+
+	for (size_t i = 1; i < deps->path_cnt; i++)
+	{
+		bufcpy(&writer, "\n");
+		write_escaped(&writer, deps->paths[i]);
+		bufcpy(&writer, ":\n");
+	}
+
+	int status = write_file(depfile_path, writer.buf, writer.cursor);
+
+	free(writer.buf);
+	return status;
+}
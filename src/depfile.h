@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdlib.h>
+
+static const size_t DEFAULT_DEP_LIST_ALLOC = 16;
+
+// Every file a compile read, in the order it was first opened
+typedef struct dep_list
+{
+	char** paths;
+	size_t path_cnt;
+	size_t paths_allocated;
+} dep_list_t;
+
+void dep_list_init(dep_list_t* deps);
+void dep_list_add(dep_list_t* deps, const char* path);
+void dep_list_free(dep_list_t* deps);
+
+int write_depfile(const char* depfile_path, const char* target, const dep_list_t* deps);
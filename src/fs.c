@@ -13,23 +13,59 @@
 
 #include "fs.h"
 
-size_t read_file(const char* filepath, char** content)
+int map_file(const char* filepath, mapped_file_t* file)
 {
+	*file = (mapped_file_t){0};
+
 	int fd = open(filepath, O_RDONLY);
 	if (fd == -1)
-		return 0;
+		return -1;
 
 	struct stat st = {0};
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return -1;
+	}
 
-	fstat(fd, &st);
-	off_t sz = st.st_size;
+	// mmap refuses empty mappings, an empty file is just an empty slice
+	if (st.st_size > 0)
+	{
+		char* fileptr = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (fileptr == MAP_FAILED)
+		{
+			close(fd);
+			return -1;
+		}
 
-	char* fileptr = (char*)mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
-	*content = (char*)calloc(sz + 1, sizeof(char));
-	memcpy(*content, fileptr, sz);
+		file->data = fileptr;
+		file->size = st.st_size;
+	}
 
-	munmap(fileptr, sz);
 	close(fd);
+	return 0;
+}
+
+void unmap_file(mapped_file_t* file)
+{
+	if (file->data)
+		munmap(file->data, file->size);
+
+	*file = (mapped_file_t){0};
+}
+
+size_t read_file(const char* filepath, char** content)
+{
+	mapped_file_t file = {0};
+	if (map_file(filepath, &file))
+		return 0;
+
+	size_t sz = file.size;
+	*content = (char*)calloc(sz + 1, sizeof(char));
+	if (sz)
+		memcpy(*content, file.data, sz);
+
+	unmap_file(&file);
 
 	return sz;
 }
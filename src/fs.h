@@ -3,5 +3,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+typedef struct mapped_file
+{
+	char* data;
+	size_t size;
+} mapped_file_t;
+
 size_t read_file(const char* filepath, char** content);
 int write_file(const char* filepath, char* content, size_t size);
+
+int map_file(const char* filepath, mapped_file_t* file);
+void unmap_file(mapped_file_t* file);
@@ -5,6 +5,8 @@
 
 #include "graph.h"
 #include "parser.h"
+#include "intern.h"
+#include "walk.h"
 
 static Agnode_t* create_node(Agraph_t* g)
 {
@@ -17,95 +19,64 @@ static Agnode_t* create_node(Agraph_t* g)
 	return node;
 }
 
-static Agnode_t* render_node(Agraph_t* g, ASTNode* node)
+static void label_node(Agnode_t* root, const ast_t* ast, const ast_node_t* node)
 {
-	if(!node) return 0;
-	Agnode_t* root = create_node(g);
-
 	char* label = 0;
 	switch(node->type)
 	{
 		case AST_NUMBER:
-			asprintf(&label, "%ld", node->data.number);
+			asprintf(&label, "%ld", ast_number(ast, node));
 			agsafeset(root, "color", "green", "");
 			break;
 		case AST_ASSIGNMENT:
-			asprintf(&label, "=");
+			asprintf(&label, "= %s", symbol_name(node->data.assignment.name));
 			agsafeset(root, "color", "red", "");
-			agedge(g, root, render_node(g, node->data.assignment.left), 0, 1);
-			agedge(g, root, render_node(g, node->data.assignment.right), 0, 1);
 			break;
 		case AST_DECLARATION:
 			agsafeset(root, "color", "cyan", "");
-			asprintf(&label, "vardecl");
-			agedge(g, root, render_node(g, node->data.declaration.identifier), 0, 1);
-			agedge(g, root, render_node(g, node->data.declaration.initializer), 0, 1);
+			asprintf(&label, "vardecl: %s", symbol_name(node->data.declaration.name));
 			break;
 		case AST_FUNCTION:
 			agsafeset(root, "color", "cyan", "");
-			asprintf(&label, "function");
-			agset(agedge(g, root, render_node(g, node->data.function.name), 0, 1), "color", "green");
-			for (size_t i = 0; i < node->data.function.param_count; ++i) 
-			{
-				Agedge_t* edge = agedge(g, root, render_node(g, node->data.function.parameters[i]), 0, 1);
-				agsafeset(edge, "color", "cyan", "");
-				agsafeset(edge, "label", "param", "");
-			}
-			agedge(g, root, render_node(g, node->data.function.body), 0, 1);
+			asprintf(&label, "function: %s", symbol_name(node->data.function.name));
 			break;
 		case AST_FUNCTION_CALL:
 			agsafeset(root, "color", "cyan", "");
-			asprintf(&label, "call");
-			agset(agedge(g, root, render_node(g, node->data.function_call.name), 0, 1), "color", "green");
-			for (size_t i = 0; i < node->data.function_call.arg_count; ++i) 
-			{
-				Agedge_t* edge = agedge(g, root, render_node(g, node->data.function_call.arguments[i]), 0, 1);
-				agsafeset(edge, "color", "cyan", "");
-				agsafeset(edge, "label", "param", "");
-			}
+			asprintf(&label, "call: %s", symbol_name(node->data.function_call.name));
 			break;
 		case AST_IF:
 			agsafeset(root, "color", "red", "");
 			asprintf(&label, "if");
-			agedge(g, root, render_node(g, node->data.if_statement.condition), 0, 1);
-			agedge(g, root, render_node(g, node->data.if_statement.then_branch), 0, 1);
-			// agedge(g, root, render_node(g, node->data.if_statement.else_branch), 0, 1);
 			break;
 		case AST_WHILE:
 			agsafeset(root, "color", "red", "");
 			asprintf(&label, "while");
-			agedge(g, root, render_node(g, node->data.while_statement.condition), 0, 1);
-			agedge(g, root, render_node(g, node->data.while_statement.body), 0, 1);
 			break;
 		case AST_BLOCK:
 			asprintf(&label, "block");
-			for (size_t i = 0; i < node->data.block.child_count; ++i) 
-				agedge(g, root, render_node(g, node->data.block.children[i]), 0, 1);
 			break;
 		case AST_PROGRAM:
 			asprintf(&label, "program");
-			for (size_t i = 0; i < node->data.program.child_count; ++i) 
-				agedge(g, root, render_node(g, node->data.program.children[i]), 0, 1);
 			break;
 		case AST_IDENTIFIER:
-			asprintf(&label, "ident: %s", node->data.identifier);
+			asprintf(&label, "ident: %s", symbol_name(node->data.symbol));
 			break;
 		case AST_BINARY:
-			asprintf(&label, "op: %d", node->data.binary_op.op);
+			asprintf(&label, "op: %d", node->op);
 			agsafeset(root, "color", "red", "");
-			agedge(g, root, render_node(g, node->data.binary_op.left), 0, 1);
-			agedge(g, root, render_node(g, node->data.binary_op.right), 0, 1);
 			break;
 		case AST_INLINE_ASM:
-			asprintf(&label, "inline asm: %s", node->data.identifier);
+			asprintf(&label, "inline asm: %s", ast_asm_text(ast, node));
 			agsafeset(root, "color", "purple", "");
 			agsafeset(root, "label", label, "");
 			break;
+		case AST_IMPORT:
+			asprintf(&label, "import: %s", symbol_name(node->data.symbol));
+			agsafeset(root, "color", "purple", "");
+			break;
 		case AST_RETURN:
 			asprintf(&label, "return");
 			agsafeset(root, "color", "cyan", "");
-			if(node->data.return_statement.value)
-				agedge(g, root, render_node(g, node->data.return_statement.value), 0, 1);
 			break;
 
 		default:
@@ -115,26 +86,66 @@ static Agnode_t* render_node(Agraph_t* g, ASTNode* node)
 	}
 
 	agset(root, "label", label);
+	free(label);
+}
+
+// Parameters and arguments hang off their function or call in cyan
+static void connect_node(Agraph_t* g, const ast_t* ast, const ast_walk_frame_t* parent, Agnode_t* child)
+{
+	Agedge_t* edge = agedge(g, (Agnode_t*)parent->locals[0], child, 0, 1);
+	size_t param_cnt = 0;
+
+	switch(parent->node->type)
+	{
+		case AST_FUNCTION:
+			param_cnt = ast_list_cnt(ast, parent->node->data.function.parameters);
+			break;
+		case AST_FUNCTION_CALL:
+			param_cnt = ast_list_cnt(ast, parent->node->data.function_call.arguments);
+			break;
+		default:
+			return;
+	}
+
+	if(parent->step < param_cnt)
+	{
+		agsafeset(edge, "color", "cyan", "");
+		agsafeset(edge, "label", "param", "");
+	}
+}
+
+// Pre-order: every node is created and tied to its parent when first
+// reached, the parent's step says which child it is
+static void render_ast(Agraph_t* g, const ast_t* ast)
+{
+	ast_walk_t walk;
+	ast_walk_init(&walk, ast, ast->root);
+
+	while(ast_walk_next(&walk))
+	{
+		ast_walk_frame_t* frame = ast_walk_top(&walk);
+
+		if(!frame->step)
+		{
+			Agnode_t* root = create_node(g);
+			label_node(root, ast, frame->node);
+			frame->locals[0] = root;
+
+			ast_walk_frame_t* parent = ast_walk_parent(&walk);
+			if(parent)
+				connect_node(g, ast, parent, root);
+		}
+
+		// else branches are left out of the picture
+		if(frame->node->type == AST_IF && frame->step == 2)
+			ast_walk_skip(&walk);
+	}
 
-	// if(node)
-	// {
-	// 	Agnode_t* left_node = render_node(g, node->left);
-	// 	Agedge_t* l_edge = agedge(g, root, left_node, 0, 1);
-	// 	agsafeset(l_edge, "color", "white", "");
-	// }
-	//
-	// if(node->right)
-	// {
-	// 	Agnode_t* right_node = render_node(g, node->right);
-	// 	Agedge_t* r_edge = agedge(g, root, right_node, 0, 1);
-	// 	agsafeset(r_edge, "color", "white", "");
-	// }
-
-	return root;
+	ast_walk_free(&walk);
 }
 
 
-void draw_ast(ASTNode* ast, const char* output_filename)
+void draw_ast(const ast_t* ast, const char* output_filename)
 {
 	GVC_t *gvc = gvContext();
 
@@ -142,7 +153,7 @@ void draw_ast(ASTNode* ast, const char* output_filename)
 
 	agsafeset(g, "bgcolor", "gray12", "");
 
-	render_node(g, ast);
+	render_ast(g, ast);
 	// render_obj(g, json->value.obj);
 
 	gvLayout(gvc, g, "dot");
@@ -2,4 +2,4 @@
 
 #include "parser.h"
 
-void draw_ast(ASTNode* ast, const char* output_filename);
+void draw_ast(const ast_t* ast, const char* output_filename);
@@ -0,0 +1,28 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+static const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+// FNV-1a, chaining the seed lets several pieces hash as one
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	uint64_t hash = seed;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+uint64_t hash_str(const char* str, uint64_t seed)
+{
+	// include the terminator so ("ab", "c") and ("a", "bc") differ
+	return hash_bytes(str, strlen(str) + 1, seed);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+static const uint64_t HASH_SEED = 0xcbf29ce484222325ULL;
+
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed);
+uint64_t hash_str(const char* str, uint64_t seed);
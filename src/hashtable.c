@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtable.h"
+#include "hash.h"
+
+static bool entry_matches(const hash_entry_t* entry, uint64_t hash, const char* key, size_t key_len)
+{
+	return entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0;
+}
+
+// Returns the slot holding the key, or the slot it should be inserted into
+static hash_entry_t* find_slot(const hashtable_t* table, uint64_t hash, const char* key, size_t key_len)
+{
+	size_t mask = table->capacity - 1;
+	hash_entry_t* tombstone = 0;
+
+	for (size_t i = hash & mask;; i = (i + 1) & mask)
+	{
+		hash_entry_t* entry = &table->entries[i];
+
+		if (!entry->key)
+			return tombstone ? tombstone : entry;
+
+		if (!entry->value)
+		{
+			if (!tombstone)
+				tombstone = entry;
+			continue;
+		}
+
+		if (entry_matches(entry, hash, key, key_len))
+			return entry;
+	}
+}
+
+static void rehash(hashtable_t* table, size_t capacity)
+{
+	hashtable_t grown = { .entries = (hash_entry_t*)calloc(capacity, sizeof(hash_entry_t)), .capacity = capacity };
+
+	for (size_t i = 0; i < table->capacity; i++)
+	{
+		hash_entry_t* entry = &table->entries[i];
+		if (!entry->key || !entry->value)
+			continue;
+
+		*find_slot(&grown, entry->hash, entry->key, entry->key_len) = *entry;
+		grown.count++;
+	}
+
+	free(table->entries);
+	*table = grown;
+}
+
+void hashtable_init(hashtable_t* table, size_t capacity)
+{
+	size_t pow2 = DEFAULT_HASHTABLE_CAPACITY;
+	while (pow2 < capacity)
+		pow2 *= 2;
+
+	*table = (hashtable_t){ .entries = (hash_entry_t*)calloc(pow2, sizeof(hash_entry_t)), .capacity = pow2 };
+}
+
+void* hashtable_get(const hashtable_t* table, const char* key, size_t key_len)
+{
+	if (!table->count)
+		return 0;
+
+	uint64_t hash = hash_bytes(key, key_len, HASH_SEED);
+	hash_entry_t* entry = find_slot(table, hash, key, key_len);
+
+	return entry->key ? entry->value : 0;
+}
+
+void hashtable_set(hashtable_t* table, const char* key, size_t key_len, void* value)
+{
+	// keep at least a quarter of the slots truly empty so probes terminate fast
+	if ((table->count + table->tombstones + 1) * 4 > table->capacity * 3)
+		rehash(table, table->count * 2 >= table->capacity ? table->capacity * 2 : table->capacity);
+
+	uint64_t hash = hash_bytes(key, key_len, HASH_SEED);
+	hash_entry_t* entry = find_slot(table, hash, key, key_len);
+
+	if (!entry->key)
+		table->count++;
+	else if (!entry->value)
+	{
+		table->tombstones--;
+		table->count++;
+	}
+
+	*entry = (hash_entry_t){ .key = key, .key_len = key_len, .hash = hash, .value = value };
+}
+
+void* hashtable_remove(hashtable_t* table, const char* key, size_t key_len)
+{
+	if (!table->count)
+		return 0;
+
+	uint64_t hash = hash_bytes(key, key_len, HASH_SEED);
+	hash_entry_t* entry = find_slot(table, hash, key, key_len);
+
+	if (!entry->key || !entry->value)
+		return 0;
+
+	void* value = entry->value;
+	entry->value = 0;
+	table->count--;
+	table->tombstones++;
+
+	return value;
+}
+
+void hashtable_free(hashtable_t* table)
+{
+	free(table->entries);
+	*table = (hashtable_t){0};
+}
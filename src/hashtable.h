@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+static const size_t DEFAULT_HASHTABLE_CAPACITY = 64;
+
+typedef struct hash_entry
+{
+	const char* key;	// owned by whoever owns the value
+	size_t key_len;
+	uint64_t hash;
+	void* value;
+} hash_entry_t;
+
+// Open addressing with linear probing over a power of two capacity.
+// Removed entries leave a tombstone (key set, value NULL) so probe chains
+// stay intact until the next rehash.
+typedef struct hashtable
+{
+	hash_entry_t* entries;
+	size_t capacity;
+	size_t count;
+	size_t tombstones;
+} hashtable_t;
+
+void hashtable_init(hashtable_t* table, size_t capacity);
+void* hashtable_get(const hashtable_t* table, const char* key, size_t key_len);
+void hashtable_set(hashtable_t* table, const char* key, size_t key_len, void* value);
+void* hashtable_remove(hashtable_t* table, const char* key, size_t key_len);
+void hashtable_free(hashtable_t* table);
@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "hashtable.h"
+#include "lexer.h"
+
+typedef struct interned_name
+{
+	char* name;
+	size_t len;
+} interned_name_t;
+
+static hashtable_t symbols;	// name -> symbol + 1
+static interned_name_t* names = 0;
+static size_t name_cnt = 0;
+static size_t names_allocated = 0;
+
+// Every symbol has to stay below the 32 bit limit, which also keeps the
+// symbol + 1 stored in the table from wrapping to the empty value
+static symbol_t add_name(const char* name, size_t len)
+{
+	if(name_cnt >= UINT32_MAX)
+	{
+		fprintf(stderr, "Too many distinct names, symbols are 32 bit\n");
+		exit(1);
+	}
+
+	if(name_cnt + 1 >= names_allocated)
+	{
+		names_allocated *= 2;
+		names = (interned_name_t*)realloc(names, names_allocated * sizeof(interned_name_t));
+	}
+
+	names[name_cnt] = (interned_name_t){ .name = strndup(name, len), .len = len };
+	hashtable_set(&symbols, names[name_cnt].name, len, (void*)(uintptr_t)(name_cnt + 1));
+
+	return (symbol_t)name_cnt++;
+}
+
+static void init_interner()
+{
+	if(names) return;
+
+	names_allocated = DEFAULT_SYMBOLS_ALLOC;
+	names = (interned_name_t*)calloc(names_allocated, sizeof(interned_name_t));
+	hashtable_init(&symbols, DEFAULT_SYMBOLS_ALLOC);
+
+	#define KEYWORD(WORD)	add_name(#WORD, sizeof(#WORD) - 1);
+	KEYWORDS
+	#undef KEYWORD
+}
+
+symbol_t intern(const char* name, size_t len)
+{
+	init_interner();
+
+	uintptr_t found = (uintptr_t)hashtable_get(&symbols, name, len);
+	if(found)
+		return (symbol_t)(found - 1);
+
+	return add_name(name, len);
+}
+
+const char* symbol_name(symbol_t symbol)
+{
+	init_interner();
+	return names[symbol].name;
+}
+
+size_t symbol_len(symbol_t symbol)
+{
+	init_interner();
+	return names[symbol].len;
+}
+
+void interner_free()
+{
+	for(size_t i = 0; i < name_cnt; i++)
+		free(names[i].name);
+
+	hashtable_free(&symbols);
+	free(names);
+
+	names = 0;
+	name_cnt = 0;
+	names_allocated = 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+static const size_t DEFAULT_SYMBOLS_ALLOC = 256;
+
+// Compact id of an interned name, equal names always get the same id.
+// The keywords are interned first, in KEYWORDS order.
+typedef uint32_t symbol_t;
+
+symbol_t intern(const char* name, size_t len);
+const char* symbol_name(symbol_t symbol);
+size_t symbol_len(symbol_t symbol);
+void interner_free();
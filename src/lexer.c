@@ -1,4 +1,4 @@
-#include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -6,18 +6,18 @@
 #include <stdbool.h>
 
 #include "lexer.h"
-
-#define KEYWORDS        \
-    KEYWORD(var)        \
-    KEYWORD(func)       \
-    KEYWORD(if)         \
-    KEYWORD(else)       \
-    KEYWORD(while)       \
-    KEYWORD(out)       \
-    KEYWORD(in)       \
-    KEYWORD(asm)       \
-    KEYWORD(return)       \
-
+#include "preprocessor.h"
+#include "srcmap.h"
+#include "intern.h"
+#include "scan.h"
+#include "log.h"
+
+// indexed by keyword symbol
+static const token_type_t KEYWORD_TOKENS[KEYWORD_CNT] = {
+    #define KEYWORD(WORD)   TOKEN_KW_##WORD,
+    KEYWORDS
+    #undef KEYWORD
+};
 
 
 static token_t create_token(token_type_t type)
@@ -25,9 +25,9 @@ static token_t create_token(token_type_t type)
     return (token_t){.type = type, .value = 0};
 }
 
-static token_t create_token_str(token_type_t type, const character_t* str) 
+static token_t create_token_str(token_type_t type, size_t length) 
 {
-    return (token_t){.type = type, .value = (token_value_t){.str = strdup(str)}};
+    return (token_t){.type = type, .value = (token_value_t){.length = length}};
 }
 
 static token_t create_token_num(token_type_t type, number_t num) 
@@ -45,69 +45,253 @@ static void advance(lexer_t *lexer)
     lexer->pos++;
 }
 
-static void skip_whitespace(lexer_t *lexer) 
+static void add_segment(token_text_t *text, uint32_t base, const character_t *input)
 {
-    while (current_char(lexer) == ' ' || current_char(lexer) == '\n' || current_char(lexer) == '\t' || current_char(lexer) == '\r') 
-        advance(lexer);
+    if (text->segment_cnt + 1 >= text->segments_allocated)
+    {
+        text->segments_allocated = text->segments_allocated ? text->segments_allocated * 2 : DEFAULT_LEX_SEGMENTS_ALLOC;
+        text->segments = (lex_segment_t*)realloc(text->segments, text->segments_allocated * sizeof(lex_segment_t));
+    }
+
+    text->segments[text->segment_cnt++] = (lex_segment_t){ base, input };
 }
 
-static bool is_keyword(character_t* identifier)
+static void add_expansion(token_text_t *text, character_t *owned)
 {
-    #define KEYWORD(WORD)   strcmp(identifier, #WORD) == 0 ||
+    if (text->expansion_cnt + 1 >= text->expansions_allocated)
+    {
+        text->expansions_allocated = text->expansions_allocated ? text->expansions_allocated * 2 : DEFAULT_LEX_SEGMENTS_ALLOC;
+        text->expansions = (character_t**)realloc(text->expansions, text->expansions_allocated * sizeof(character_t*));
+    }
 
-    return KEYWORDS 0;
+    text->expansions[text->expansion_cnt++] = owned;
+}
 
-    #undef KEYWORD
+// owned text is kept alive by the token text, tokens point into it
+void lexer_push_source(lexer_t *lexer, const character_t *input, size_t length, character_t *owned, bool is_file, uint32_t base)
+{
+    if (lexer->source_cnt + 1 >= lexer->sources_allocated)
+    {
+        lexer->sources_allocated *= 2;
+        lexer->sources = (lex_source_t*)realloc(lexer->sources, lexer->sources_allocated * sizeof(lex_source_t));
+    }
+
+    lexer->sources[lexer->source_cnt++] = (lex_source_t){ lexer->input, lexer->pos, lexer->length, lexer->is_file, lexer->base };
+
+    add_segment(lexer->text, base, input);
+    if (owned)
+        add_expansion(lexer->text, owned);
+
+    lexer->input = input;
+    lexer->pos = 0;
+    lexer->length = length;
+    lexer->is_file = is_file;
+    lexer->base = base;
+    lexer->line_start = true;
+}
+
+static void pop_source(lexer_t *lexer)
+{
+    if (lexer->is_file && preprocess_source_end(lexer->pp))
+        lexer->failed = true;
+
+    lex_source_t *source = &lexer->sources[--lexer->source_cnt];
+    lexer->input = source->input;
+    lexer->pos = source->pos;
+    lexer->length = source->length;
+    lexer->is_file = source->is_file;
+    lexer->base = source->base;
+    lexer->line_start = false;
+}
+
+static uint32_t current_offset(lexer_t *lexer)
+{
+    return lexer->base + lexer->pos;
 }
 
+static size_t line_end(lexer_t *lexer)
+{
+    const character_t *newline = memchr(lexer->input + lexer->pos, '\n', lexer->length - lexer->pos);
+    return newline ? (size_t)(newline - lexer->input) : lexer->length;
+}
 
-static character_t *read_identifier(lexer_t *lexer) 
+static void lex_directive(lexer_t *lexer)
 {
     size_t start = lexer->pos;
-    while ((current_char(lexer) >= 'a' && current_char(lexer) <= 'z') ||
-        (current_char(lexer) >= 'A' && current_char(lexer) <= 'Z') ||
-        (current_char(lexer) >= '0' && current_char(lexer) <= '9') ||
-        current_char(lexer) == '_') {
-        advance(lexer);
+    lexer->pos = line_end(lexer);
+    lexer->line_start = false;
+
+    if (preprocess_directive(lexer->pp, lexer, lexer->input + start, lexer->pos - start))
+        lexer->failed = true;
+}
+
+// Replaces the rest of the line with its macro expansion when the
+// identifier at the cursor names a macro
+static bool expand_macro(lexer_t *lexer)
+{
+    size_t start = lexer->pos;
+    size_t end = start + scan_identifier(lexer->input + start, lexer->length - start);
+
+    size_t eol = line_end(lexer);
+    character_t *expanded = 0;
+    size_t expanded_len = 0;
+    uint32_t base = 0;
+
+    if (preprocess_macro(lexer->pp, lexer->input + start, end - start, lexer->input + eol, &expanded, &expanded_len, &base))
+    {
+        lexer->failed = true;
+        return true;
     }
 
-    int length = lexer->pos - start;
-    character_t *identifier = (character_t *)calloc(length + 1, sizeof(character_t));
-    strncpy(identifier, lexer->input + start, length);
-    identifier[length] = '\0';
+    if (!expanded)
+        return false;
 
-    return identifier;
+    lexer->pos = eol;
+    lexer_push_source(lexer, expanded, expanded_len, expanded, false, base);
+    return true;
 }
 
-static number_t read_number(lexer_t *lexer) 
+static void skip_whitespace(lexer_t *lexer) 
 {
-    static character_t num_buf[128] = { 0 };
+    while (!lexer->failed)
+    {
+        character_t c = current_char(lexer);
 
-    size_t start = lexer->pos;
-    while (current_char(lexer) >= '0' && current_char(lexer) <= '9') 
-        advance(lexer);
+        // a whole run at once, only its last character decides whether a
+        // directive may follow
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') 
+        {
+            lexer->pos += scan_whitespace(lexer->input + lexer->pos, lexer->length - lexer->pos);
+            lexer->line_start = lexer->input[lexer->pos - 1] == '\n';
+            continue;
+        }
+
+        if (!lexer->pp)
+            return;
+
+        if (lexer->pos >= lexer->length)
+        {
+            if (!lexer->source_cnt)
+                return;
+
+            pop_source(lexer);
+            continue;
+        }
+
+        if (lexer->line_start && c == '#' && lexer->is_file)
+        {
+            lex_directive(lexer);
+            continue;
+        }
+
+        if ((c == '/' && lexer->pos + 1 < lexer->length && lexer->input[lexer->pos + 1] == '/') || !preprocess_active(lexer->pp))
+        {
+            lexer->pos = line_end(lexer);
+            continue;
+        }
+
+        return;
+    }
+}
+
+static size_t read_identifier(lexer_t *lexer) 
+{
+    size_t length = scan_identifier(lexer->input + lexer->pos, lexer->length - lexer->pos);
+    lexer->pos += length;
+
+    return length;
+}
+
+static int digit_value(character_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+        return (c | 0x20) - 'a' + 10;
+    return 16;
+}
+
+// 0x and 0b literals, bits_per_digit at a time, past 64 bits is an overflow
+static bool read_radix_number(lexer_t *lexer, unsigned bits_per_digit, uint64_t *value)
+{
+    int radix = 1 << bits_per_digit;
+    bool fits = true;
+    *value = 0;
+
+    for (int digit = 0; (digit = digit_value(current_char(lexer))) < radix; advance(lexer))
+    {
+        if (*value >> (64 - bits_per_digit))
+            fits = false;
+        *value = (*value << bits_per_digit) | (uint64_t)digit;
+    }
+
+    return fits;
+}
+
+// Integer literals are exact. Decimal ones go up to INT64_MAX, 0x and 0b
+// ones may use all 64 bits and come out negative. A 0x or 0b without a
+// digit after it is still a 0 followed by an identifier.
+static bool read_number(lexer_t *lexer, number_t *number) 
+{
+    const character_t *text = lexer->input + lexer->pos;
+    size_t left = lexer->length - lexer->pos;
+    uint64_t value = 0;
+    bool fits = true;
 
-    size_t length = lexer->pos - start;
-    strncpy(num_buf, lexer->input + start, length);
-    num_buf[length] = '\0';
+    if (left > 2 && text[0] == '0' && (text[1] | 0x20) == 'x' && digit_value(text[2]) < 16)
+    {
+        lexer->pos += 2;
+        fits = read_radix_number(lexer, 4, &value);
+    }
+    else if (left > 2 && text[0] == '0' && (text[1] | 0x20) == 'b' && digit_value(text[2]) < 2)
+    {
+        lexer->pos += 2;
+        fits = read_radix_number(lexer, 1, &value);
+    }
+    else
+    {
+        size_t length = scan_digits(text, left);
+        lexer->pos += length;
+        fits = scan_decimal_value(text, length, &value) && value <= INT64_MAX;
+    }
 
-    character_t* end = 0;
-    number_t number = strtod(num_buf, &end);
-    return number;
+    if (!fits)
+    {
+        fprintf(stderr, "Integer literal out of range: %.*s\n", (int)(lexer->input + lexer->pos - text), text);
+        lexer->failed = true;
+        return false;
+    }
+
+    *number = (number_t)value;
+    return true;
 }
 
 #define TOKEN_CHAR(TOKEN, CHAR, STR)                 \
 if (c == CHAR)                                      \
 {                                                   \
     advance(lexer);                                 \
-    return create_token_str(TOKEN, STR);            \
+    return create_token_str(TOKEN, 1);              \
 }                                                   \
 
 
-token_t next_token(lexer_t *lexer) 
+// one hash lookup tells keywords and names apart
+static void intern_identifier(token_t *token, const character_t *identifier)
+{
+    symbol_t symbol = intern(identifier, token->value.length);
+    token->type = symbol < KEYWORD_CNT ? KEYWORD_TOKENS[symbol] : TOKEN_IDENTIFIER;
+    token->value.symbol = symbol;
+}
+
+static token_t scan_token(lexer_t *lexer) 
 {
     skip_whitespace(lexer);
+    lexer->token_start = current_offset(lexer);
+    if (lexer->failed)
+        return create_token(TOKEN_EOF);
+
     character_t c = current_char(lexer);
+    if (lexer->pp && c != '\0')
+        preprocess_token_seen(lexer->pp);
 
     if (c == '\0') 
     {
@@ -141,79 +325,373 @@ token_t next_token(lexer_t *lexer)
         if(next == '=') 
         {
             advance(lexer);
-            return create_token_str(TOKEN_EQUALS, "==");
+            return create_token_str(TOKEN_EQUALS, 2);
         }
 
-        return create_token_str(TOKEN_ASSIGN, "=");
+        return create_token_str(TOKEN_ASSIGN, 1);
     }
 
-    if (isalpha(c) || c == '_') 
+    if (scan_identifier_start(lexer->input + lexer->pos, lexer->length - lexer->pos)) 
     {
-        character_t *identifier = read_identifier(lexer);
-        if (is_keyword(identifier)) 
-            return create_token_str(TOKEN_KEYWORD, identifier);
-
-        return create_token_str(TOKEN_IDENTIFIER, identifier);
+        if (lexer->pp && lexer->is_file && expand_macro(lexer))
+            return scan_token(lexer);
+
+        const character_t *identifier = lexer->input + lexer->pos;
+        token_t token = create_token_str(TOKEN_IDENTIFIER, read_identifier(lexer));
+        if (!lexer->defer_intern)
+            intern_identifier(&token, identifier);
+        return token;
     } 
 
+    number_t number = 0;
     if (c >= '0' && c <= '9') 
-        return create_token_num(TOKEN_NUMBER, read_number(lexer));
+        return read_number(lexer, &number) ? create_token_num(TOKEN_NUMBER, number) : create_token(TOKEN_EOF);
 
-    fprintf(stderr, "Unexpected character: %c\n", c);
+    if (c & 0x80)
+        fprintf(stderr, "Unexpected character: byte 0x%02x is not part of a UTF-8 letter\n", (unsigned char)c);
+    else
+        fprintf(stderr, "Unexpected character: %c\n", c);
+    lexer->failed = true;
     return create_token(TOKEN_EOF);
 }
 
-void print_token(token_t token)
+token_t next_token(lexer_t *lexer)
+{
+    token_t token = scan_token(lexer);
+    token.offset = lexer->token_start;
+    return token;
+}
+
+// Finds the segment holding the token, a single buffer takes no search
+const character_t* token_spelling(const token_text_t* text, uint32_t offset)
+{
+    size_t low = 0, high = text->segment_cnt;
+    while (low + 1 < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (text->segments[mid].base <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    return text->segments[low].text + (offset - text->segments[low].base);
+}
+
+void print_token(const token_text_t* text, token_t token)
 {
-    printf("Token (%d): ", token.type);
-    
     if(token.type == TOKEN_NUMBER)
+        log_write(LOG_lexer, "Token (%d): %ld", token.type, token.value.number);
+    else if(token.type != TOKEN_EOF)
+        log_write(LOG_lexer, "Token (%d): %.*s", token.type, (int)token.value.length, token_spelling(text, token.offset));
+    else
+        log_write(LOG_lexer, "Token (%d): EOF", token.type);
+}
+
+void token_text_free(token_text_t* text)
+{
+    for (size_t i = 0; i < text->expansion_cnt; i++)
+        free(text->expansions[i]);
+
+    for (size_t i = 0; i < text->mapping_cnt; i++)
+        unmap_file(&text->mappings[i]);
+
+    free(text->segments);
+    free(text->expansions);
+    free(text->mappings);
+    *text = (token_text_t){0};
+}
+
+void token_array_init(token_array_t* array, bool offsets)
+{
+    *array = (token_array_t){ .tokens_allocated = INITIAL_TOKEN_ALLOC };
+    array->kinds = (token_type_t*)calloc(array->tokens_allocated, sizeof(token_type_t));
+    array->values = (token_value_t*)calloc(array->tokens_allocated, sizeof(token_value_t));
+    if (offsets)
+        array->offsets = (uint32_t*)calloc(array->tokens_allocated, sizeof(uint32_t));
+}
+
+void token_array_push(token_array_t* array, token_t token)
+{
+    if (array->token_cnt >= array->tokens_allocated)
+    {
+        array->tokens_allocated *= 2;
+        array->kinds = (token_type_t*)realloc(array->kinds, array->tokens_allocated * sizeof(token_type_t));
+        array->values = (token_value_t*)realloc(array->values, array->tokens_allocated * sizeof(token_value_t));
+        if (array->offsets)
+            array->offsets = (uint32_t*)realloc(array->offsets, array->tokens_allocated * sizeof(uint32_t));
+    }
+
+    array->kinds[array->token_cnt] = token.type;
+    array->values[array->token_cnt] = token.value;
+    if (array->offsets)
+        array->offsets[array->token_cnt] = token.offset;
+    array->token_cnt++;
+}
+
+token_t token_array_get(const token_array_t* array, size_t i)
+{
+    return (token_t){ .type = array->kinds[i], .offset = array->offsets ? array->offsets[i] : 0, .value = array->values[i] };
+}
+
+void token_array_free(token_array_t* array)
+{
+    free(array->kinds);
+    free(array->values);
+    free(array->offsets);
+    *array = (token_array_t){0};
+}
+
+// Lexes one more token into the ring, after the end or a failed
+// directive the stream keeps yielding EOF
+static void fill_token(token_stream_t *stream)
+{
+    size_t slot = stream->lexed % TOKEN_RING_SIZE;
+    token_t token = {0};
+
+    if (stream->done)
+        token = (token_t){ .type = TOKEN_EOF, .offset = stream->offsets[(stream->lexed - 1) % TOKEN_RING_SIZE] };
+    else
     {
-        printf("%ld\n", token.value.number);
+        if (stream->tokens.kinds)
+        {
+            token = token_array_get(&stream->tokens, stream->lexed);
+
+            // the lex stopped at an error up front, the stream fails once
+            // the parser gets there
+            if (token.type == TOKEN_EOF && stream->tokens.failed)
+                stream->lexer.failed = true;
+        }
+        else
+            token = next_token(&stream->lexer);
+
+        if (stream->lexer.failed)
+            token = create_token(TOKEN_EOF);
+
+        if (LOG_ENABLED(lexer, TRACE))
+            print_token(stream->lexer.text, token);
+        stream->done = token.type == TOKEN_EOF;
+    }
+
+    stream->kinds[slot] = token.type;
+    stream->values[slot] = token.value;
+    stream->offsets[slot] = token.offset;
+    stream->lexed++;
+}
+
+// Lexes on demand, only the tokens from the current one up to the deepest
+// lookahead asked for are kept, so ahead has to stay below TOKEN_RING_SIZE
+static size_t ring_slot(token_stream_t *stream, size_t ahead)
+{
+    while (stream->lexed <= stream->position + ahead)
+        fill_token(stream);
+
+    return (stream->position + ahead) % TOKEN_RING_SIZE;
+}
+
+token_type_t token_kind(token_stream_t* stream, size_t ahead)
+{
+    return stream->kinds[ring_slot(stream, ahead)];
+}
+
+const token_value_t* token_value(token_stream_t* stream, size_t ahead)
+{
+    return &stream->values[ring_slot(stream, ahead)];
+}
+
+uint32_t token_offset(token_stream_t* stream, size_t ahead)
+{
+    return stream->offsets[ring_slot(stream, ahead)];
+}
+
+void token_advance(token_stream_t* stream)
+{
+    ring_slot(stream, 0);
+    stream->position++;
+}
+
+// The tokens point into input, which has to outlive them. Token offsets
+// are 32 bit, a longer input fails the stream right away.
+void token_stream_open(token_stream_t* stream, const char* input, token_text_t* text)
+{
+    size_t length = strlen(input);
+
+    *stream = (token_stream_t){ .lexer = { .input = input, .length = length, .text = text } };
+    add_segment(text, 0, input);
+
+    if (length > SRC_OFFSET_MAX)
+    {
+        fprintf(stderr, "Input exceeds 4 GiB, token offsets are 32 bit\n");
+        stream->lexer.failed = true;
+    }
+}
+
+// Lexes the whole input up front on several threads, the stream then hands
+// out the merged tokens
+void token_stream_open_parallel(token_stream_t* stream, const char* input, token_text_t* text, size_t thread_cnt)
+{
+    token_stream_open(stream, input, text);
+    if (stream->lexer.failed)
         return;
+
+    token_array_init(&stream->tokens, true);
+    lex_parallel(input, thread_cnt, &stream->tokens);
+}
+
+// Preprocesses while lexing, the expanded text never exists as a whole.
+// The tokens point into the include files and the macro expansions, the
+// preprocessor has to stay alive until the stream is closed.
+int token_stream_open_fused(token_stream_t* stream, struct preprocessor* pp, const char* file_path, token_text_t* text)
+{
+    *stream = (token_stream_t){ .lexer = { .pp = pp, .text = text, .sources_allocated = DEFAULT_LEX_SOURCES_ALLOC } };
+    stream->lexer.sources = (lex_source_t*)calloc(stream->lexer.sources_allocated, sizeof(lex_source_t));
+
+    return preprocess_fused_begin(pp, file_path, &stream->lexer);
+}
+
+// Takes the include file mappings over from the preprocessor, so the
+// spellings outlive it. Fails if the preprocessor reported an error,
+// closing again does nothing more.
+int token_stream_close(token_stream_t* stream)
+{
+    lexer_t *lexer = &stream->lexer;
+    struct preprocessor *pp = lexer->pp;
+
+    if (pp)
+    {
+        token_text_t *text = lexer->text;
+        text->mappings = (mapped_file_t*)calloc(pp->file_cnt + 1, sizeof(mapped_file_t));
+        for (size_t i = 0; i < pp->file_cnt; i++)
+        {
+            text->mappings[text->mapping_cnt++] = pp->files[i].source;
+            pp->files[i].source = (mapped_file_t){0};
+        }
+        lexer->pp = 0;
     }
 
-    if(token.value.str) printf("%s\n", token.value.str);
+    free(lexer->sources);
+    token_array_free(&stream->tokens);
+    lexer->sources = 0;
+    return lexer->failed;
 }
 
-void free_token(token_t token)
+// The lexer or the preprocessor has reported an error, the EOF the stream
+// yields since is no fault of the program's
+bool token_stream_failed(const token_stream_t* stream)
 {
-    if(token.value.str && token.type != TOKEN_NUMBER)
-        free(token.value.str);
+    return stream->lexer.failed;
 }
 
-void free_tokens(token_t* tokens)
+typedef struct lex_chunk
 {
-        size_t i = 0;
-	do 
+    lexer_t lexer;
+    token_array_t tokens;       // ends with the chunk's EOF
+} lex_chunk_t;
+
+static void* lex_chunk(void *arg)
+{
+    lex_chunk_t *chunk = (lex_chunk_t*)arg;
+    token_t token = {0};
+
+    token_array_init(&chunk->tokens, true);
+    do
+    {
+        token = next_token(&chunk->lexer);
+        token_array_push(&chunk->tokens, token);
+    } while (token.type != TOKEN_EOF);
+
+    return 0;
+}
+
+// Chunks end right after a newline, no token spans one
+static size_t split_chunks(const char *input, size_t length, size_t chunk_cnt, lex_chunk_t *chunks)
+{
+    size_t start = 0, used = 0;
+
+    while (start < length && used < chunk_cnt)
+    {
+        size_t end = length;
+        if (used + 1 < chunk_cnt)
         {
-		free_token(tokens[i]);
-                i++;
-	} while (tokens[i - 1].type != TOKEN_EOF);
+            size_t target = start + (length - start) / (chunk_cnt - used);
+            const character_t *newline = memchr(input + target, '\n', length - target);
+            if (newline)
+                end = (size_t)(newline - input) + 1;
+        }
+
+        chunks[used++].lexer = (lexer_t){ .input = input + start, .length = end - start, .base = (uint32_t)start, .defer_intern = chunk_cnt > 1 };
+        start = end;
+    }
 
-        free(tokens);
+    return used;
 }
 
-token_t* lex(const char* text)
+// Splits the input at newlines and lexes the pieces concurrently. The
+// interner is not thread safe, so the chunks leave identifiers unresolved
+// and they are interned in order while merging, which keeps the symbol ids
+// and the tokens identical to a sequential lex. The tokens are appended to
+// an initialized array, which only keeps offsets if it was asked to. The
+// input has to fit in 32 bit offsets, token_stream_open_parallel() checks.
+void lex_parallel(const char* input, size_t thread_cnt, token_array_t* tokens)
 {
-    lexer_t lexer = (lexer_t){text, 0, strlen(text)};
+    size_t length = strlen(input);
+    size_t chunk_cnt = length / LEX_MIN_CHUNK_SIZE;
+    if (chunk_cnt > thread_cnt)
+        chunk_cnt = thread_cnt;
+    if (!chunk_cnt)
+        chunk_cnt = 1;
+
+    lex_chunk_t *chunks = (lex_chunk_t*)calloc(chunk_cnt, sizeof(lex_chunk_t));
+    pthread_t *threads = (pthread_t*)calloc(chunk_cnt, sizeof(pthread_t));
+    bool *started = (bool*)calloc(chunk_cnt, sizeof(bool));
+
+    chunk_cnt = split_chunks(input, length, chunk_cnt, chunks);
+    if (!chunk_cnt)
+        chunks[chunk_cnt++].lexer = (lexer_t){ .input = input };
 
-    size_t allocated = INITIAL_TOKEN_ALLOC, i = 0;
-    token_t* tokens = (token_t*)calloc(allocated * sizeof(token_t), sizeof(token_t));
+    for (size_t i = 1; i < chunk_cnt; i++)
+        started[i] = !pthread_create(&threads[i], 0, lex_chunk, &chunks[i]);
 
-    do 
+    lex_chunk(&chunks[0]);
+
+    for (size_t i = 0; i < chunk_cnt; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], 0);
+        else if (i)
+            lex_chunk(&chunks[i]);
+    }
+
+    for (size_t i = 0; i < chunk_cnt; i++)
     {
-        tokens[i] = next_token(&lexer);
-        print_token(tokens[i]);
-        i++;
-        if(i >= allocated)
+        lex_chunk_t *chunk = &chunks[i];
+        size_t token_cnt = chunk->tokens.token_cnt;
+
+        // an unexpected character ends the chunk early, and the whole
+        // stream with it, like it would sequentially
+        bool last = i + 1 == chunk_cnt || chunk->tokens.offsets[token_cnt - 1] < chunk->lexer.base + chunk->lexer.length;
+        size_t copied = last ? token_cnt : token_cnt - 1;
+
+        for (size_t j = 0; j < copied; j++)
         {
-            allocated *= 2;
-            tokens = realloc(tokens, allocated * sizeof(token_t));
+            token_t token = token_array_get(&chunk->tokens, j);
+            if (token.type == TOKEN_IDENTIFIER && chunk->lexer.defer_intern)
+                intern_identifier(&token, input + token.offset);
+
+            token_array_push(tokens, token);
         }
-    } while (tokens[i - 1].type != TOKEN_EOF);
 
-    tokens = realloc(tokens, i * sizeof(token_t));
+        if (last)
+        {
+            tokens->failed = chunk->lexer.failed;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < chunk_cnt; i++)
+        token_array_free(&chunks[i].tokens);
 
-    return tokens;
+    free(chunks);
+    free(threads);
+    free(started);
 }
@@ -2,12 +2,40 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
+#include "fs.h"
+
+static const size_t DEFAULT_LEX_SOURCES_ALLOC = 16;
 static const size_t INITIAL_TOKEN_ALLOC = 128;
+static const size_t DEFAULT_LEX_THREADS = 1;
+static const size_t LEX_MIN_CHUNK_SIZE = 64 * 1024;     // smaller pieces are not worth a thread
+static const size_t DEFAULT_LEX_SEGMENTS_ALLOC = 16;
 
 typedef int64_t number_t;
 typedef char character_t;
 
+#define KEYWORDS        \
+    KEYWORD(var)        \
+    KEYWORD(func)       \
+    KEYWORD(if)         \
+    KEYWORD(else)       \
+    KEYWORD(while)      \
+    KEYWORD(out)        \
+    KEYWORD(in)         \
+    KEYWORD(asm)        \
+    KEYWORD(return)     \
+    KEYWORD(import)     \
+
+// also the symbol ids the interner hands the keywords
+typedef enum KEYWORD_IDS
+{
+    #define KEYWORD(WORD)   KEYWORD_##WORD,
+    KEYWORDS
+    #undef KEYWORD
+    KEYWORD_CNT
+} keyword_t;
+
 typedef enum TOKEN_TYPES : uint8_t
 {
     TOKEN_EOF = 0,
@@ -17,7 +45,6 @@ typedef enum TOKEN_TYPES : uint8_t
     TOKEN_RBRACE,
     TOKEN_COMMA,
     TOKEN_SEMICOLON,
-    TOKEN_KEYWORD,
     TOKEN_IDENTIFIER,
     TOKEN_NUMBER,
     TOKEN_PLUS,
@@ -31,29 +58,131 @@ typedef enum TOKEN_TYPES : uint8_t
     TOKEN_ASSIGN,
     TOKEN_AMPERSAND,
     TOKEN_BAR,
+
+    #define KEYWORD(WORD)   TOKEN_KW_##WORD,
+    KEYWORDS
+    #undef KEYWORD
+    TOKEN_TYPE_CNT
 } token_type_t;
 
 typedef union 
 {
         number_t number;
-        character_t* str;
+        struct {
+            uint32_t length;    // everything but numbers: the spelling is a view into the lexed text
+            uint32_t symbol;    // identifiers and keywords: interned name
+        };
 } token_value_t;
 
 typedef struct token 
 {
     token_type_t type;
+    uint32_t offset;            // global offset of the first character, resolved through a srcmap_t
     token_value_t value;
 } token_t;
 
+struct preprocessor;
+
+// A piece of text tokens point into, starting at base in the global offsets
+typedef struct lex_segment
+{
+    uint32_t base;
+    const character_t *text;
+} lex_segment_t;
+
+// Owns whatever the tokens' spellings live in: nothing for a plain stream,
+// the macro expansions and include file mappings for a fused one
+typedef struct token_text
+{
+    lex_segment_t *segments;    // sorted by base
+    size_t segment_cnt;
+    size_t segments_allocated;
+
+    character_t **expansions;
+    size_t expansion_cnt;
+    size_t expansions_allocated;
+
+    mapped_file_t *mappings;
+    size_t mapping_cnt;
+} token_text_t;
+
+typedef struct lex_source
+{
+    const character_t *input;
+    size_t pos;
+    size_t length;
+    bool is_file;
+    uint32_t base;
+} lex_source_t;
+
 typedef struct lexer 
 {
     const character_t *input;
     size_t pos;
     size_t length;
+
+    // fused mode: input is the top of a stack of include and macro sources,
+    // directives and comments are handled while skipping whitespace
+    struct preprocessor *pp;
+    bool is_file;               // lines starting with # are directives
+    bool line_start;
+    bool failed;
+    bool defer_intern;          // parallel chunks: identifiers are interned when merging
+
+    uint32_t base;              // global offset of input[0]
+    uint32_t token_start;
+    token_text_t *text;
+
+    lex_source_t *sources;
+    size_t source_cnt;
+    size_t sources_allocated;
 } lexer_t;
 
-token_t* lex(const char* text);
+// Tokens as parallel arrays, a kind check only touches the dense kinds
+typedef struct token_array
+{
+    token_type_t *kinds;
+    token_value_t *values;
+    uint32_t *offsets;          // NULL when neither locations nor spellings are needed
+    size_t token_cnt;
+    size_t tokens_allocated;
+    bool failed;                // the lex stopped at an error, the last EOF stands for it
+} token_array_t;
+
+// Enough for the parser's one-token lookahead, a power of two
+#define TOKEN_RING_SIZE 4
+
+// The parser pulls tokens one at a time, only the last few are kept
+typedef struct token_stream
+{
+    lexer_t lexer;
+    token_type_t kinds[TOKEN_RING_SIZE];
+    token_value_t values[TOKEN_RING_SIZE];
+    uint32_t offsets[TOKEN_RING_SIZE];
+    size_t position;            // tokens consumed
+    size_t lexed;               // tokens pulled out of the lexer
+    bool done;                  // EOF was lexed
+
+    token_array_t tokens;       // lexed up front by lex_parallel(), empty otherwise
+} token_stream_t;
+
+void token_array_init(token_array_t* array, bool offsets);
+void token_array_push(token_array_t* array, token_t token);
+token_t token_array_get(const token_array_t* array, size_t i);
+void token_array_free(token_array_t* array);
+
+void token_stream_open(token_stream_t* stream, const char* input, token_text_t* text);
+void token_stream_open_parallel(token_stream_t* stream, const char* input, token_text_t* text, size_t thread_cnt);
+int token_stream_open_fused(token_stream_t* stream, struct preprocessor* pp, const char* file_path, token_text_t* text);
+int token_stream_close(token_stream_t* stream);
+bool token_stream_failed(const token_stream_t* stream);
+token_type_t token_kind(token_stream_t* stream, size_t ahead);
+const token_value_t* token_value(token_stream_t* stream, size_t ahead);
+uint32_t token_offset(token_stream_t* stream, size_t ahead);
+void token_advance(token_stream_t* stream);
+void lex_parallel(const char* input, size_t thread_cnt, token_array_t* tokens);
+void lexer_push_source(lexer_t *lexer, const character_t *input, size_t length, character_t *owned, bool is_file, uint32_t base);
 token_t next_token(lexer_t *lexer);
-void print_token(token_t token);
-void free_token(token_t token);
-void free_tokens(token_t* tokens);
+const character_t* token_spelling(const token_text_t* text, uint32_t offset);
+void print_token(const token_text_t* text, token_t token);
+void token_text_free(token_text_t* text);
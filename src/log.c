@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+#include "io.h"
+
+uint8_t log_levels[LOG_CATEGORY_CNT] = {
+	#define LOG_CATEGORY(NAME)	DEFAULT_LOG_LEVEL,
+	LOG_CATEGORIES
+	#undef LOG_CATEGORY
+};
+
+static const char* CATEGORY_NAMES[LOG_CATEGORY_CNT] = {
+	#define LOG_CATEGORY(NAME)	#NAME,
+	LOG_CATEGORIES
+	#undef LOG_CATEGORY
+};
+
+static const char* LEVEL_NAMES[] = { "error", "warn", "info", "debug", "trace" };
+
+static int find_name(const char** names, size_t name_cnt, const char* name, size_t len)
+{
+	for (size_t i = 0; i < name_cnt; i++)
+	{
+		if (strlen(names[i]) == len && !strncasecmp(names[i], name, len))
+			return (int)i;
+	}
+
+	return -1;
+}
+
+static int find_level(const char* name, size_t len)
+{
+	return find_name(LEVEL_NAMES, sizeof(LEVEL_NAMES) / sizeof(LEVEL_NAMES[0]), name, len);
+}
+
+int log_configure(const char* spec)
+{
+	while (*spec)
+	{
+		size_t len = strcspn(spec, ",");
+		const char* equals = memchr(spec, '=', len);
+
+		if (!equals)
+		{
+			int level = find_level(spec, len);
+			if (level < 0)
+				goto unknown;
+
+			for (size_t i = 0; i < LOG_CATEGORY_CNT; i++)
+				log_levels[i] = (uint8_t)level;
+		}
+		else
+		{
+			int category = find_name(CATEGORY_NAMES, LOG_CATEGORY_CNT, spec, (size_t)(equals - spec));
+			int level = find_level(equals + 1, len - (size_t)(equals - spec) - 1);
+			if (category < 0 || level < 0)
+				goto unknown;
+
+			log_levels[category] = (uint8_t)level;
+		}
+
+		spec += len;
+		if (*spec == ',')
+			spec++;
+	}
+
+	return 0;
+
+unknown:
+	print_error("unknown log category or level, expected [category=]error|warn|info|debug|trace");
+	return 1;
+}
+
+void log_write(log_category_t category, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	fprintf(stderr, "[%s] ", CATEGORY_NAMES[category]);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+
+	va_end(args);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Diagnostics chatter, split by category and level. Levels above
+// LOG_MAX_LEVEL are compiled out, arguments and all. The rest cost one
+// compare against the category's runtime level until they are enabled.
+
+#define LOG_LEVEL_ERROR	0
+#define LOG_LEVEL_WARN	1
+#define LOG_LEVEL_INFO	2
+#define LOG_LEVEL_DEBUG	3
+#define LOG_LEVEL_TRACE	4
+
+#ifndef LOG_MAX_LEVEL
+#ifdef _DEBUG
+#define LOG_MAX_LEVEL	LOG_LEVEL_TRACE
+#else
+#define LOG_MAX_LEVEL	LOG_LEVEL_INFO
+#endif
+#endif
+
+#define DEFAULT_LOG_LEVEL	LOG_LEVEL_WARN
+
+#define LOG_CATEGORIES			\
+	LOG_CATEGORY(driver)		\
+	LOG_CATEGORY(lexer)		\
+	LOG_CATEGORY(parser)		\
+	LOG_CATEGORY(translator)	\
+
+typedef enum LOG_CATEGORY_IDS
+{
+	#define LOG_CATEGORY(NAME)	LOG_##NAME,
+	LOG_CATEGORIES
+	#undef LOG_CATEGORY
+	LOG_CATEGORY_CNT
+} log_category_t;
+
+extern uint8_t log_levels[LOG_CATEGORY_CNT];
+
+#define LOG_ENABLED(CATEGORY, LEVEL)	\
+	(LOG_LEVEL_##LEVEL <= LOG_MAX_LEVEL && LOG_LEVEL_##LEVEL <= log_levels[LOG_##CATEGORY])
+
+#define LOG_AT(CATEGORY, LEVEL, ...)					\
+	do								\
+	{								\
+		if (LOG_ENABLED(CATEGORY, LEVEL))			\
+			log_write(LOG_##CATEGORY, __VA_ARGS__);		\
+	} while (0)
+
+#define LOG_DISCARD(CATEGORY, ...)	do {} while (0)
+
+#define LOG_ERROR(CATEGORY, ...)	LOG_AT(CATEGORY, ERROR, __VA_ARGS__)
+#define LOG_WARN(CATEGORY, ...)		LOG_AT(CATEGORY, WARN, __VA_ARGS__)
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(CATEGORY, ...)		LOG_AT(CATEGORY, INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(CATEGORY, ...)		LOG_DISCARD(CATEGORY, __VA_ARGS__)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(CATEGORY, ...)	LOG_AT(CATEGORY, DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(CATEGORY, ...)	LOG_DISCARD(CATEGORY, __VA_ARGS__)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(CATEGORY, ...)	LOG_AT(CATEGORY, TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(CATEGORY, ...)	LOG_DISCARD(CATEGORY, __VA_ARGS__)
+#endif
+
+// "debug" sets every category, "lexer=trace,driver=info" single ones
+int log_configure(const char* spec);
+void log_write(log_category_t category, const char* format, ...) __attribute__((format(printf, 2, 3)));
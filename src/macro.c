@@ -0,0 +1,337 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+#include "hashtable.h"
+#include "buffer.h"
+#include "io.h"
+
+typedef struct macro_arg
+{
+	const char* start;
+	size_t len;
+} macro_arg_t;
+
+// Any non-ASCII byte belongs to an identifier here, the lexer validates
+// the UTF-8. This keeps macros from expanding inside a UTF-8 identifier.
+bool is_ident_start(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (c & 0x80);
+}
+
+bool is_ident_char(char c)
+{
+	return is_ident_start(c) || (c >= '0' && c <= '9');
+}
+
+static const char* skip_blanks(const char* cursor, const char* end)
+{
+	while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+		cursor++;
+	return cursor;
+}
+
+static const char* trim_blanks(const char* start, const char* end)
+{
+	while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+		end--;
+	return end;
+}
+
+static const char* read_ident(const char* cursor, const char* end)
+{
+	if (cursor >= end || !is_ident_start(*cursor))
+		return cursor;
+
+	while (cursor < end && is_ident_char(*cursor))
+		cursor++;
+	return cursor;
+}
+
+static void free_macro(macro_t* macro)
+{
+	for (size_t i = 0; i < macro->param_cnt; i++)
+		free(macro->params[i]);
+
+	free(macro->params);
+	free(macro->name);
+	free(macro->body);
+	free(macro);
+}
+
+void macros_init(macro_table_t* table)
+{
+	*table = (macro_table_t){0};
+	hashtable_init(&table->macros, DEFAULT_HASHTABLE_CAPACITY);
+}
+
+macro_t* macro_find(const macro_table_t* table, const char* name, size_t len)
+{
+	return (macro_t*)hashtable_get(&table->macros, name, len);
+}
+
+// Parses everything after "#define": NAME body, or NAME(a, b) body
+int macro_define(macro_table_t* table, const char* definition, size_t len)
+{
+	const char *end = definition + len;
+	const char *name = skip_blanks(definition, end);
+	const char *name_end = read_ident(name, end);
+
+	if (name == name_end)
+	{
+		print_error("Malformed #define, expected a macro name");
+		return 1;
+	}
+
+	macro_t* macro = (macro_t*)calloc(1, sizeof(macro_t));
+	macro->name = strndup(name, name_end - name);
+	macro->name_len = name_end - name;
+
+	const char *cursor = name_end;
+
+	// only a parenthesis glued to the name makes a function-like macro
+	if (cursor < end && *cursor == '(')
+	{
+		macro->function_like = true;
+		macro->params = (char**)calloc(MAX_MACRO_PARAMS, sizeof(char*));
+
+		cursor = skip_blanks(cursor + 1, end);
+		while (cursor < end && *cursor != ')')
+		{
+			const char *param_end = read_ident(cursor, end);
+			if (param_end == cursor || macro->param_cnt >= MAX_MACRO_PARAMS)
+				break;
+
+			macro->params[macro->param_cnt++] = strndup(cursor, param_end - cursor);
+
+			cursor = skip_blanks(param_end, end);
+			if (cursor < end && *cursor == ',')
+				cursor = skip_blanks(cursor + 1, end);
+		}
+
+		if (cursor >= end || *cursor != ')')
+		{
+			print_error("Malformed #define parameter list");
+			free_macro(macro);
+			return 1;
+		}
+		cursor++;
+	}
+
+	cursor = skip_blanks(cursor, end);
+	macro->body_len = trim_blanks(cursor, end) - cursor;
+	macro->body = strndup(cursor, macro->body_len);
+
+	macro_t* previous = (macro_t*)hashtable_remove(&table->macros, macro->name, macro->name_len);
+	if (previous)
+		free_macro(previous);
+
+	hashtable_set(&table->macros, macro->name, macro->name_len, macro);
+	table->generation++;
+
+	return 0;
+}
+
+void macro_undef(macro_table_t* table, const char* name, size_t len)
+{
+	macro_t* macro = (macro_t*)hashtable_remove(&table->macros, name, len);
+	if (macro)
+		free_macro(macro);
+
+	table->generation++;
+}
+
+// Splits "(a, f(b, c))" into its top level arguments. Returns a pointer
+// past the closing parenthesis, or NULL if the call is not closed on this line.
+static const char* read_args(const char* cursor, const char* end, macro_arg_t* args, size_t* arg_cnt)
+{
+	size_t depth = 0;
+	const char *arg_start = cursor + 1;
+	*arg_cnt = 0;
+
+	for (cursor++; cursor < end; cursor++)
+	{
+		if (*cursor == '(')
+			depth++;
+
+		if (*cursor == ')' && depth)
+		{
+			depth--;
+			continue;
+		}
+
+		if ((*cursor != ',' && *cursor != ')') || depth)
+			continue;
+
+		if (*arg_cnt >= MAX_MACRO_PARAMS)
+			return 0;
+
+		const char *start = skip_blanks(arg_start, cursor);
+		args[(*arg_cnt)++] = (macro_arg_t){ start, trim_blanks(start, cursor) - start };
+		arg_start = cursor + 1;
+
+		if (*cursor == ')')
+			return cursor + 1;
+	}
+
+	return 0;
+}
+
+static void substitute_args(const macro_t* macro, const macro_arg_t* args, buf_writer_t* out)
+{
+	const char *cursor = macro->body, *end = macro->body + macro->body_len;
+
+	while (cursor < end)
+	{
+		const char *run = cursor;
+		while (cursor < end && !is_ident_start(*cursor))
+			cursor++;
+		bufslice(out, run, cursor - run);
+
+		const char *ident = cursor;
+		cursor = read_ident(cursor, end);
+
+		size_t param = 0;
+		while (param < macro->param_cnt && (strlen(macro->params[param]) != (size_t)(cursor - ident) || strncmp(macro->params[param], ident, cursor - ident)))
+			param++;
+
+		if (param < macro->param_cnt)
+			bufslice(out, args[param].start, args[param].len);
+		else
+			bufslice(out, ident, cursor - ident);
+	}
+}
+
+static int expand_macro_body(macro_table_t* table, macro_t* macro, const char* body, size_t len, buf_writer_t* out)
+{
+	// a macro never expands inside its own expansion, that is what stops recursion
+	macro->disabled = true;
+	int status = macro_expand(table, body, len, out);
+	macro->disabled = false;
+
+	return status;
+}
+
+static int expand_function_macro(macro_table_t* table, macro_t* macro, const char** cursor, const char* end, buf_writer_t* out)
+{
+	macro_arg_t args[MAX_MACRO_PARAMS];
+	size_t arg_cnt = 0;
+
+	const char *after_args = read_args(*cursor, end, args, &arg_cnt);
+	if (!after_args)
+	{
+		print_error("Unterminated macro argument list");
+		return 1;
+	}
+
+	// F() passes one empty argument, which is no argument at all for F
+	if (!macro->param_cnt && arg_cnt == 1 && !args[0].len)
+		arg_cnt = 0;
+
+	if (arg_cnt != macro->param_cnt)
+	{
+		print_error("Macro argument count mismatch");
+		return 1;
+	}
+
+	// arguments are fully expanded before they are substituted, the
+	// macro itself is still enabled at this point
+	buf_writer_t expanded = { .buf = (char*)calloc(DEFAULT_MACRO_EXPANSION_ALLOC, sizeof(char)), .buf_len = DEFAULT_MACRO_EXPANSION_ALLOC };
+	size_t arg_offsets[MAX_MACRO_PARAMS];
+	int status = 0;
+
+	for (size_t i = 0; i < arg_cnt && !status; i++)
+	{
+		arg_offsets[i] = expanded.cursor;
+		status = macro_expand(table, args[i].start, args[i].len, &expanded);
+		args[i].len = expanded.cursor - arg_offsets[i];
+	}
+
+	for (size_t i = 0; i < arg_cnt; i++)
+		args[i].start = expanded.buf + arg_offsets[i];
+
+	buf_writer_t substituted = { .buf = (char*)calloc(DEFAULT_MACRO_EXPANSION_ALLOC, sizeof(char)), .buf_len = DEFAULT_MACRO_EXPANSION_ALLOC };
+	if (!status)
+	{
+		substitute_args(macro, args, &substituted);
+		status = expand_macro_body(table, macro, substituted.buf, substituted.cursor, out);
+	}
+
+	free(substituted.buf);
+	free(expanded.buf);
+
+	*cursor = after_args;
+	return status;
+}
+
+// Single pass over the text: runs between identifiers are copied in bulk,
+// every identifier costs one hash lookup and only macro bodies are rescanned
+int macro_expand(macro_table_t* table, const char* text, size_t len, buf_writer_t* out)
+{
+	const char *cursor = text, *end = text + len;
+
+	while (cursor < end)
+	{
+		const char *run = cursor;
+		while (cursor < end && !is_ident_start(*cursor))
+		{
+			// the tail of a number like 12abc is not an identifier
+			if (*cursor >= '0' && *cursor <= '9')
+			{
+				while (cursor < end && is_ident_char(*cursor))
+					cursor++;
+				continue;
+			}
+			cursor++;
+		}
+		bufslice(out, run, cursor - run);
+
+		if (cursor >= end)
+			break;
+
+		const char *ident = cursor;
+		cursor = read_ident(cursor, end);
+
+		macro_t* macro = macro_find(table, ident, cursor - ident);
+		if (!macro || macro->disabled)
+		{
+			bufslice(out, ident, cursor - ident);
+			continue;
+		}
+
+		if (!macro->function_like)
+		{
+			if (expand_macro_body(table, macro, macro->body, macro->body_len, out))
+				return 1;
+			continue;
+		}
+
+		// a function-like macro name without arguments is left alone
+		const char *paren = skip_blanks(cursor, end);
+		if (paren >= end || *paren != '(')
+		{
+			bufslice(out, ident, cursor - ident);
+			continue;
+		}
+
+		cursor = paren;
+		if (expand_function_macro(table, macro, &cursor, end, out))
+			return 1;
+	}
+
+	return 0;
+}
+
+void macros_free(macro_table_t* table)
+{
+	for (size_t i = 0; i < table->macros.capacity; i++)
+	{
+		if (table->macros.entries[i].value)
+			free_macro((macro_t*)table->macros.entries[i].value);
+	}
+
+	hashtable_free(&table->macros);
+	*table = (macro_table_t){0};
+}
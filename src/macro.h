@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "hashtable.h"
+
+#define MAX_MACRO_PARAMS	64	// sizes arrays on the stack, so not a static const
+static const size_t DEFAULT_MACRO_EXPANSION_ALLOC = 64;
+
+typedef struct macro
+{
+	char* name;
+	size_t name_len;
+
+	bool function_like;
+	char** params;
+	size_t param_cnt;
+
+	char* body;
+	size_t body_len;
+
+	bool disabled;		// set while the macro's own expansion is being scanned
+} macro_t;
+
+typedef struct macro_table
+{
+	hashtable_t macros;
+	size_t generation;	// bumped on every #define/#undef
+} macro_table_t;
+
+void macros_init(macro_table_t* table);
+int macro_define(macro_table_t* table, const char* definition, size_t len);
+void macro_undef(macro_table_t* table, const char* name, size_t len);
+macro_t* macro_find(const macro_table_t* table, const char* name, size_t len);
+int macro_expand(macro_table_t* table, const char* text, size_t len, buf_writer_t* out);
+void macros_free(macro_table_t* table);
+
+bool is_ident_start(char c);
+bool is_ident_char(char c);
@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "lexer.h"
 #include "parser.h"
@@ -8,6 +12,13 @@
 #include "translator.h"
 #include "preprocessor.h"
 #include "fs.h"
+#include "cache.h"
+#include "depfile.h"
+#include "module.h"
+#include "srcmap.h"
+#include "intern.h"
+#include "io.h"
+#include "log.h"
 
 /*	TODO:
  *	frontend
@@ -37,36 +48,338 @@ void assemble(const char* asm_path, const char* out_path)
 const char* __asan_default_options() { return "detect_leaks=0"; }
 
 
+typedef struct compile_options
+{
+	const char* source_path;
+	const char* cache_dir;
+	size_t prefetch_threads;
+	size_t lex_threads;	// -L: lex the preprocessed text in parallel chunks
+	bool fused;
+	bool module;		// -m: write an interface for importers instead of out.s
+
+	const char** defines;
+	size_t define_cnt;
+
+	const char** include_dirs;
+	size_t include_dir_cnt;
+
+	const char* depfile_path;	// set by -MD or -MF, NULL when no depfile is wanted
+} compile_options_t;
+
+static const char* ASM_OUTPUT_PATH = "out.s";
+static const char* DEFAULT_DEPFILE_PATH = "out.d";
+
+static void print_usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-F] [-m] [-c cache_dir] [-j prefetch_threads] [-L lex_threads] [-v [category=]level[,...]] [-D name[=value]]... [-I dir]... [-MD] [-MF depfile] <source file>\n", name);
+}
+
+static int parse_options(int argc, char** argv, compile_options_t* options)
+{
+	*options = (compile_options_t){
+		.prefetch_threads = DEFAULT_PREFETCH_THREADS,
+		.lex_threads = DEFAULT_LEX_THREADS,
+		.defines = (const char**)calloc(argc, sizeof(char*)),
+		.include_dirs = (const char**)calloc(argc, sizeof(char*)),
+	};
+
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "Fmc:j:L:D:I:M:v:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'F':
+				options->fused = true;
+				break;
+			case 'm':
+				options->module = true;
+				break;
+			case 'c':
+				options->cache_dir = optarg;
+				break;
+			case 'j':
+				options->prefetch_threads = strtoul(optarg, 0, 10);
+				break;
+			case 'L':
+				options->lex_threads = strtoul(optarg, 0, 10);
+				break;
+			case 'v':
+				if (log_configure(optarg))
+					return 1;
+				break;
+			case 'D':
+				options->defines[options->define_cnt++] = optarg;
+				break;
+			case 'I':
+				options->include_dirs[options->include_dir_cnt++] = optarg;
+				break;
+			// -MD, -MF depfile and -MFdepfile
+			case 'M':
+				if (!strcmp(optarg, "D"))
+				{
+					if (!options->depfile_path)
+						options->depfile_path = DEFAULT_DEPFILE_PATH;
+					break;
+				}
+				if (optarg[0] == 'F' && (optarg[1] || optind < argc))
+				{
+					options->depfile_path = optarg[1] ? optarg + 1 : argv[optind++];
+					break;
+				}
+				print_usage(argv[0]);
+				return 1;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	options->source_path = argv[optind];
+	return 0;
+}
+
+static int init_preprocessor(const compile_options_t* options, preprocessor_t* pp, srcmap_t* map)
+{
+	preprocessor_init(pp, options->prefetch_threads);
+	pp->srcmap = map;
+
+	for (size_t i = 0; i < options->include_dir_cnt; i++)
+		resolver_add_dir(&pp->resolver, options->include_dirs[i]);
+
+	for (size_t i = 0; i < options->define_cnt; i++)
+	{
+		if (preprocessor_define(pp, options->defines[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+// Either hands out a mapping of the cached expansion or runs the
+// preprocessor, storing its result for the next compile
+static int load_source(const compile_options_t* options, char** source_text, mapped_file_t* cached, dep_list_t* deps, srcmap_t* map)
+{
+	preprocess_cache_t cache = {0};
+	preprocessor_t pp = {0};
+	int status = 0;
+
+	if (options->cache_dir)
+	{
+		char cwd[PATH_MAX] = {0};
+		char* root = realpath(options->source_path, 0);
+
+		cache_init(&cache, options->cache_dir);
+		cache_key_add(&cache, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+		cache_key_add(&cache, root ? root : options->source_path);
+		for (size_t i = 0; i < options->define_cnt; i++)
+			cache_key_add(&cache, options->defines[i]);
+		for (size_t i = 0; i < options->include_dir_cnt; i++)
+			cache_key_add(&cache, options->include_dirs[i]);
+		free(root);
+
+		if (!cache_lookup(&cache, cached, deps, map))
+		{
+			*source_text = cached->data;
+			goto exit;
+		}
+	}
+
+	status = init_preprocessor(options, &pp, map);
+
+	if (!status)
+		status = preprocess(&pp, options->source_path, source_text);
+
+	if (!status && options->cache_dir)
+		cache_store(&cache, &pp, *source_text, strlen(*source_text));
+
+	if (!status)
+		preprocessor_deps(&pp, deps);
+
+	preprocessor_free(&pp);
+exit:
+	cache_free(&cache);
+	return status;
+}
+
+// Fused mode lexes straight out of the include tree as the parser pulls
+// tokens, there is no expanded text to print or cache
+static int open_tokens_fused(const compile_options_t* options, preprocessor_t* pp, srcmap_t* map, token_stream_t* tokens, token_text_t* text)
+{
+	if (init_preprocessor(options, pp, map))
+		return 1;
+
+	return token_stream_open_fused(tokens, pp, options->source_path, text);
+}
+
+// Loads the interface of every module the program imports, together with
+// the modules those were compiled against
+static int load_imports(const compile_options_t* options, const ast_t* ast, module_list_t* modules, module_interface_t* module, dep_list_t* deps)
+{
+	include_resolver_t resolver = {0};
+	int status = 0;
+
+	resolver_init(&resolver);
+	for (size_t i = 0; i < options->include_dir_cnt; i++)
+		resolver_add_dir(&resolver, options->include_dirs[i]);
+
+	ast_list_t children = ast_node(ast, ast->root)->data.block.children;
+	for (size_t i = 0; i < ast_list_cnt(ast, children) && !status; i++)
+	{
+		const ast_node_t* child = ast_node(ast, ast_list_items(ast, children)[i]);
+		const char* interface_path = 0;
+
+		if (child->type != AST_IMPORT)
+			continue;
+
+		status = modules_import(modules, &resolver, symbol_name(child->data.symbol), &interface_path);
+		if (!status)
+			module_add_import(module, interface_path);
+	}
+
+	for (size_t i = 0; i < modules->module_cnt && !status; i++)
+		dep_list_add(deps, modules->modules[i].path);
+
+	resolver_free(&resolver);
+	return status;
+}
+
+static int write_module(const compile_options_t* options, const ast_t* ast, const module_list_t* modules, module_interface_t* module, const dep_list_t* deps)
+{
+	struct stat st = {0};
+	char* prefix = module_label_prefix(options->source_path);
+	char* interface_path = module_interface_path(options->source_path);
+
+	module->source_path = realpath(options->source_path, 0);
+	if (module->source_path && !stat(module->source_path, &st))
+	{
+		module->source_size = (size_t)st.st_size;
+		module->source_mtime = st.st_mtim;
+	}
+
+	// includes and imported interfaces, kept by absolute path since the
+	// interface may be loaded from another directory
+	for (size_t i = 0; i < deps->path_cnt; i++)
+	{
+		char* path = realpath(deps->paths[i], 0);
+		if (path && (!module->source_path || strcmp(path, module->source_path)) && !stat(path, &st))
+			module_add_dep(module, path, (size_t)st.st_size, st.st_mtim);
+		free(path);
+	}
+
+	translate_module(ast, modules, prefix, module);
+
+	LOG_DEBUG(driver, "MODULE %s: \n\n%s\n", interface_path, module->code);
+
+	int status = module_write(module, interface_path);
+
+	if (!status && options->depfile_path)
+		status = write_depfile(options->depfile_path, interface_path, deps);
+
+	free(interface_path);
+	free(prefix);
+	return status;
+}
+
 int main(int argc, char** argv)
 {
 	char* source_text = 0;
-	// size_t len = read_file(argv[1], &source_text);
+	mapped_file_t cached_text = {0};
+	compile_options_t options = {0};
+	dep_list_t deps = {0};
+	module_list_t modules = {0};
+	module_interface_t module = {0};
+	srcmap_t locations = {0};
+	token_text_t token_text = {0};
+	preprocessor_t pp = {0};
+	token_stream_t tokens = {0};
+	ast_t ast = {0};
+	int status = 1;
+
+	dep_list_init(&deps);
+	modules_init(&modules);
+	module_init(&module);
+	srcmap_init(&locations);
 
-	if(preprocess(argv[1], &source_text))
+	if (parse_options(argc, argv, &options))
 		goto exit;
 
-	printf("preprocessed text: %s\n", source_text);
+	if (options.fused)
+	{
+		if (open_tokens_fused(&options, &pp, &locations, &tokens, &token_text))
+			goto exit;
+	}
+	else
+	{
+		if (load_source(&options, &source_text, &cached_text, &deps, &locations))
+			goto exit;
+
+		LOG_DEBUG(driver, "preprocessed text: %s", source_text);
+		if (options.lex_threads > 1)
+			token_stream_open_parallel(&tokens, source_text, &token_text, options.lex_threads);
+		else
+			token_stream_open(&tokens, source_text, &token_text);
+	}
+
+	ast_init(&ast);
+	parse_program(&tokens, &token_text, &locations, &ast);
 
-	token_t* tokens = lex(source_text);
+	// a directive may have failed halfway through the parse
+	if (token_stream_close(&tokens))
+		goto free_program;
 
-	ASTNode* ast = parse_program(tokens);
+	if (options.fused)
+		preprocessor_deps(&pp, &deps);
 
-	draw_ast(ast, "ast.png");
+	if (LOG_ENABLED(driver, DEBUG))
+		draw_ast(&ast, "ast.png");
 
-	printf("Parsed program successfully.\n");
+	LOG_INFO(driver, "Parsed program successfully.");
 
-	buf_writer_t asm_buf = translate(ast);
+	if (load_imports(&options, &ast, &modules, &module, &deps))
+		goto free_program;
 
-	printf("COMPILATION RESULT: \n\n%s\n\n", asm_buf.buf);
+	if (options.module)
+	{
+		if (!write_module(&options, &ast, &modules, &module, &deps))
+			status = 0;
+		goto free_program;
+	}
 
-	write_file("out.s", asm_buf.buf, strlen(asm_buf.buf));
+	buf_writer_t asm_buf = translate(&ast, &modules);
 
-	assemble("out.s", "a.out");
+	LOG_DEBUG(driver, "COMPILATION RESULT: \n\n%s\n", asm_buf.buf);
+
+	write_file(ASM_OUTPUT_PATH, asm_buf.buf, strlen(asm_buf.buf));
+
+	if (!options.depfile_path || !write_depfile(options.depfile_path, ASM_OUTPUT_PATH, &deps))
+		status = 0;
+
+	assemble(ASM_OUTPUT_PATH, "a.out");
 
-	free_tokens(tokens);
-	free_ast(ast);
 	free(asm_buf.buf);
+free_program:
+	ast_free(&ast);
 exit:
-	free(source_text);
-	return 0;
+	token_stream_close(&tokens);
+	if (options.fused)
+		preprocessor_free(&pp);
+	if (cached_text.data)
+		unmap_file(&cached_text);
+	else
+		free(source_text);
+	dep_list_free(&deps);
+	modules_free(&modules);
+	module_free(&module);
+	srcmap_free(&locations);
+	token_text_free(&token_text);
+	interner_free();
+	free(options.defines);
+	free(options.include_dirs);
+	return status;
 }
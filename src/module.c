@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "module.h"
+#include "buffer.h"
+#include "fs.h"
+#include "io.h"
+#include "preprocessor.h"
+
+void module_init(module_interface_t* module)
+{
+	*module = (module_interface_t){
+		.imports = (char**)calloc(DEFAULT_MODULE_EXPORTS_ALLOC, sizeof(char*)),
+		.imports_allocated = DEFAULT_MODULE_EXPORTS_ALLOC,
+		.deps = (module_dep_t*)calloc(DEFAULT_MODULE_EXPORTS_ALLOC, sizeof(module_dep_t)),
+		.deps_allocated = DEFAULT_MODULE_EXPORTS_ALLOC,
+		.exports = (module_export_t*)calloc(DEFAULT_MODULE_EXPORTS_ALLOC, sizeof(module_export_t)),
+		.exports_allocated = DEFAULT_MODULE_EXPORTS_ALLOC,
+	};
+}
+
+void module_add_import(module_interface_t* module, const char* interface_path)
+{
+	if (module->import_cnt + 1 >= module->imports_allocated)
+	{
+		module->imports_allocated *= 2;
+		module->imports = (char**)realloc(module->imports, module->imports_allocated * sizeof(char*));
+	}
+
+	module->imports[module->import_cnt++] = strdup(interface_path);
+}
+
+void module_add_dep(module_interface_t* module, const char* path, size_t size, struct timespec mtime)
+{
+	if (module->dep_cnt + 1 >= module->deps_allocated)
+	{
+		module->deps_allocated *= 2;
+		module->deps = (module_dep_t*)realloc(module->deps, module->deps_allocated * sizeof(module_dep_t));
+	}
+
+	module->deps[module->dep_cnt++] = (module_dep_t){ .path = strdup(path), .size = size, .mtime = mtime };
+}
+
+void module_add_export(module_interface_t* module, const char* name, size_t arg_cnt, const char* label)
+{
+	if (module->export_cnt + 1 >= module->exports_allocated)
+	{
+		module->exports_allocated *= 2;
+		module->exports = (module_export_t*)realloc(module->exports, module->exports_allocated * sizeof(module_export_t));
+	}
+
+	module->exports[module->export_cnt++] = (module_export_t){ .name = strdup(name), .arg_cnt = arg_cnt, .label = strdup(label) };
+}
+
+// One header line per fact, the assembly follows the "code" line verbatim
+int module_write(const module_interface_t* module, const char* path)
+{
+	buf_writer_t writer = { .buf = (char*)calloc(DEFAULT_PREPROCESSOR_ALLOC, sizeof(char)), .buf_len = DEFAULT_PREPROCESSOR_ALLOC };
+	char* line = 0;
+
+	bufncpy(&writer, MODULE_INTERFACE_MAGIC);
+
+	if (module->source_path)
+	{
+		asprintf(&line, "source %zu %ld %ld %s", module->source_size, module->source_mtime.tv_sec, module->source_mtime.tv_nsec, module->source_path);
+		bufncpy(&writer, line);
+		free(line);
+	}
+
+	for (size_t i = 0; i < module->import_cnt; i++)
+	{
+		bufcpy(&writer, "import ");
+		bufncpy(&writer, module->imports[i]);
+	}
+
+	for (size_t i = 0; i < module->dep_cnt; i++)
+	{
+		asprintf(&line, "dep %zu %ld %ld %s", module->deps[i].size, module->deps[i].mtime.tv_sec, module->deps[i].mtime.tv_nsec, module->deps[i].path);
+		bufncpy(&writer, line);
+		free(line);
+	}
+
+	for (size_t i = 0; i < module->export_cnt; i++)
+	{
+		asprintf(&line, "func %zu %s %s", module->exports[i].arg_cnt, module->exports[i].label, module->exports[i].name);
+		bufncpy(&writer, line);
+		free(line);
+	}
+
+	bufncpy(&writer, "code");
+	if (module->code)
+		bufcpy(&writer, module->code);
+
+	int status = write_file(path, writer.buf, writer.cursor);
+
+	free(writer.buf);
+	return status;
+}
+
+static int parse_header_line(module_interface_t* module, char* line)
+{
+	int offset = 0;
+
+	if (sscanf(line, "source %zu %ld %ld %n", &module->source_size, &module->source_mtime.tv_sec, &module->source_mtime.tv_nsec, &offset) == 3 && offset)
+	{
+		module->source_path = strdup(line + offset);
+		return 0;
+	}
+
+	module_dep_t dep = {0};
+	if (sscanf(line, "dep %zu %ld %ld %n", &dep.size, &dep.mtime.tv_sec, &dep.mtime.tv_nsec, &offset) == 3 && offset)
+	{
+		module_add_dep(module, line + offset, dep.size, dep.mtime);
+		return 0;
+	}
+
+	if (!strncmp(line, "import ", strlen("import ")))
+	{
+		module_add_import(module, line + strlen("import "));
+		return 0;
+	}
+
+	size_t arg_cnt = 0;
+	char label[NAME_MAX + 1] = {0};
+	if (sscanf(line, "func %zu %255s %n", &arg_cnt, label, &offset) == 2 && offset)
+	{
+		module_add_export(module, line + offset, arg_cnt, label);
+		return 0;
+	}
+
+	return 1;
+}
+
+int module_load(const char* path, module_interface_t* module)
+{
+	char* content = 0;
+	module_init(module);
+
+	if (!read_file(path, &content))
+	{
+		free(content);
+		return 1;
+	}
+
+	module->path = strdup(path);
+
+	char* line = content;
+	char* end = strchr(line, '\n');
+	if (!end || (size_t)(end - line) != strlen(MODULE_INTERFACE_MAGIC) || strncmp(line, MODULE_INTERFACE_MAGIC, end - line))
+		goto invalid;
+
+	for (line = end + 1; (end = strchr(line, '\n')); line = end + 1)
+	{
+		*end = '\0';
+
+		if (!strcmp(line, "code"))
+		{
+			module->code = strdup(end + 1);
+			free(content);
+			return 0;
+		}
+
+		if (parse_header_line(module, line))
+			goto invalid;
+	}
+
+invalid:
+	free(content);
+	return 1;
+}
+
+void module_free(module_interface_t* module)
+{
+	for (size_t i = 0; i < module->import_cnt; i++)
+		free(module->imports[i]);
+
+	for (size_t i = 0; i < module->dep_cnt; i++)
+		free(module->deps[i].path);
+
+	for (size_t i = 0; i < module->export_cnt; i++)
+	{
+		free(module->exports[i].name);
+		free(module->exports[i].label);
+	}
+
+	free(module->imports);
+	free(module->deps);
+	free(module->exports);
+	free(module->source_path);
+	free(module->path);
+	free(module->code);
+	*module = (module_interface_t){0};
+}
+
+// lib.ykk -> lib.ykki, the interface sits next to its source
+char* module_interface_path(const char* source_path)
+{
+	const char* slash = strrchr(source_path, '/');
+	const char* dot = strrchr(source_path, '.');
+	size_t stem_len = (dot && (!slash || dot > slash)) ? (size_t)(dot - source_path) : strlen(source_path);
+
+	char* path = 0;
+	asprintf(&path, "%.*s%s", (int)stem_len, source_path, MODULE_INTERFACE_EXT);
+	return path;
+}
+
+// Labels of a module start with its name so that two separately compiled
+// units can never hand out the same one
+char* module_label_prefix(const char* source_path)
+{
+	const char* slash = strrchr(source_path, '/');
+	const char* name = slash ? slash + 1 : source_path;
+	const char* dot = strrchr(name, '.');
+	size_t name_len = dot ? (size_t)(dot - name) : strlen(name);
+
+	char* prefix = (char*)calloc(name_len + 2, sizeof(char));
+	for (size_t i = 0; i < name_len; i++)
+		prefix[i] = isalnum((unsigned char)name[i]) ? name[i] : '_';
+	prefix[name_len] = '_';
+
+	return prefix;
+}
+
+void modules_init(module_list_t* list)
+{
+	*list = (module_list_t){ .modules = (module_interface_t*)calloc(DEFAULT_MODULES_ALLOC, sizeof(module_interface_t)), .modules_allocated = DEFAULT_MODULES_ALLOC };
+}
+
+static bool file_changed(const char* path, size_t size, struct timespec mtime)
+{
+	struct stat st = {0};
+	return stat(path, &st)
+		|| (size_t)st.st_size != size
+		|| st.st_mtim.tv_sec != mtime.tv_sec
+		|| st.st_mtim.tv_nsec != mtime.tv_nsec;
+}
+
+// Returns the file that changed since the interface was written, NULL if
+// it is up to date
+static const char* module_stale(const module_interface_t* module)
+{
+	struct stat st = {0};
+
+	// interfaces may be shipped without their source, and then without
+	// their includes as well
+	if (!module->source_path || stat(module->source_path, &st))
+		return 0;
+
+	if (file_changed(module->source_path, module->source_size, module->source_mtime))
+		return module->source_path;
+
+	for (size_t i = 0; i < module->dep_cnt; i++)
+	{
+		if (file_changed(module->deps[i].path, module->deps[i].size, module->deps[i].mtime))
+			return module->deps[i].path;
+	}
+
+	return 0;
+}
+
+// The chain of interfaces being loaded, one link per recursion level
+typedef struct module_load_frame
+{
+	const char* path;
+	const struct module_load_frame* parent;
+} module_load_frame_t;
+
+static void print_import_cycle(const module_load_frame_t* frame, const char* path)
+{
+	fprintf(stderr, "Module import cycle: %s", path);
+	for (; frame; frame = frame->parent)
+	{
+		fprintf(stderr, " <- %s", frame->path);
+		if (!strcmp(frame->path, path))
+			break;
+	}
+	fputc('\n', stderr);
+}
+
+static int load_module(module_list_t* list, const char* path, const char** loaded_path, const module_load_frame_t* parent)
+{
+	char* real = realpath(path, 0);
+	if (!real)
+	{
+		fprintf(stderr, "Could not open module interface %s\n", path);
+		return 1;
+	}
+
+	for (const module_load_frame_t* frame = parent; frame; frame = frame->parent)
+	{
+		if (!strcmp(frame->path, real))
+		{
+			print_import_cycle(parent, real);
+			free(real);
+			return 1;
+		}
+	}
+
+	for (size_t i = 0; i < list->module_cnt; i++)
+	{
+		if (strcmp(list->modules[i].path, real) == 0)
+		{
+			*loaded_path = list->modules[i].path;
+			free(real);
+			return 0;
+		}
+	}
+
+	module_interface_t module = {0};
+	if (module_load(real, &module))
+	{
+		fprintf(stderr, "Invalid module interface %s\n", real);
+		module_free(&module);
+		free(real);
+		return 1;
+	}
+	free(real);
+
+	const char* changed = module_stale(&module);
+	if (changed)
+	{
+		fprintf(stderr, "Module interface %s is out of date (%s changed), rebuild it from %s with -m\n", module.path, changed, module.source_path);
+		module_free(&module);
+		return 1;
+	}
+
+	// dependencies go first, the list stays in a valid load order; the
+	// module is only listed once they are, the chain catches cycles
+	module_load_frame_t frame = { .path = module.path, .parent = parent };
+	for (size_t i = 0; i < module.import_cnt; i++)
+	{
+		const char* dependency = 0;
+		if (load_module(list, module.imports[i], &dependency, &frame))
+		{
+			module_free(&module);
+			return 1;
+		}
+	}
+
+	if (list->module_cnt + 1 >= list->modules_allocated)
+	{
+		list->modules_allocated *= 2;
+		list->modules = (module_interface_t*)realloc(list->modules, list->modules_allocated * sizeof(module_interface_t));
+	}
+
+	list->modules[list->module_cnt] = module;
+	*loaded_path = list->modules[list->module_cnt++].path;
+	return 0;
+}
+
+// Finds name.ykki on the include search path and loads it together with
+// everything it imports. *interface_path is owned by the list.
+int modules_import(module_list_t* list, include_resolver_t* resolver, const char* name, const char** interface_path)
+{
+	char* file_name = 0;
+	asprintf(&file_name, "%s%s", name, MODULE_INTERFACE_EXT);
+
+	const char* path = resolve_include(resolver, file_name, strlen(file_name));
+	int status = 1;
+
+	if (path)
+		status = load_module(list, path, interface_path, 0);
+	else
+		fprintf(stderr, "Could not find module %s (%s), build it with -m\n", name, file_name);
+
+	free(file_name);
+	return status;
+}
+
+void modules_free(module_list_t* list)
+{
+	for (size_t i = 0; i < list->module_cnt; i++)
+		module_free(&list->modules[i]);
+
+	free(list->modules);
+	*list = (module_list_t){0};
+}
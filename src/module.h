@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "preprocessor.h"
+
+static const char* MODULE_INTERFACE_MAGIC = "ykkmod 2";
+static const char* MODULE_INTERFACE_EXT = ".ykki";
+static const size_t DEFAULT_MODULE_EXPORTS_ALLOC = 16;
+static const size_t DEFAULT_MODULES_ALLOC = 8;
+
+// A file the module's assembly was produced from besides its source: an
+// include or the interface of an import. Labels of a rebuilt import move,
+// so any of them changing makes the interface stale.
+typedef struct module_dep
+{
+	char* path;
+	size_t size;
+	struct timespec mtime;
+} module_dep_t;
+
+typedef struct module_export
+{
+	char* name;
+	size_t arg_cnt;
+	char* label;
+} module_export_t;
+
+// What an importing unit needs from a compiled module: the functions it can
+// call, the modules it depends on and its already translated assembly
+typedef struct module_interface
+{
+	char* path;
+
+	// the module source at the time it was compiled, a stale interface is refused
+	char* source_path;
+	size_t source_size;
+	struct timespec source_mtime;
+
+	char** imports;		// interface paths
+	size_t import_cnt;
+	size_t imports_allocated;
+
+	module_dep_t* deps;
+	size_t dep_cnt;
+	size_t deps_allocated;
+
+	module_export_t* exports;
+	size_t export_cnt;
+	size_t exports_allocated;
+
+	char* code;
+} module_interface_t;
+
+// Every module a unit needs, direct imports and their own imports alike
+typedef struct module_list
+{
+	module_interface_t* modules;
+	size_t module_cnt;
+	size_t modules_allocated;
+} module_list_t;
+
+void module_init(module_interface_t* module);
+void module_add_import(module_interface_t* module, const char* interface_path);
+void module_add_dep(module_interface_t* module, const char* path, size_t size, struct timespec mtime);
+void module_add_export(module_interface_t* module, const char* name, size_t arg_cnt, const char* label);
+int module_write(const module_interface_t* module, const char* path);
+int module_load(const char* path, module_interface_t* module);
+void module_free(module_interface_t* module);
+
+char* module_interface_path(const char* source_path);
+char* module_label_prefix(const char* source_path);
+
+void modules_init(module_list_t* list);
+int modules_import(module_list_t* list, include_resolver_t* resolver, const char* name, const char** interface_path);
+void modules_free(module_list_t* list);
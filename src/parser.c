@@ -11,468 +11,556 @@
 #include "parser.h"
 #include "debugger.h"
 #include "buffer.h"
+#include "srcmap.h"
+#include "log.h"
+#include "ast.h"
+
+static token_stream_t* tokens;
+static const token_text_t* token_text;
+static srcmap_t* locations;
+static ast_t* tree;
+
+// Kind checks only read the dense kind array, values are fetched once a
+// token is actually used
+static token_type_t current_kind() {
+    return token_kind(tokens, 0);
+}
 
-static token_t* tokens;
-static size_t token_index;
-
-static token_t* current_token() {
-    return &tokens[token_index];
+static const token_value_t* current_value() {
+    return token_value(tokens, 0);
 }
 
 static void advance_token() {
-    token_index++;
+    token_advance(tokens);
 }
 
-ASTNode* parse_expression_priority();
+static ast_index_t parse_binary();
+
+// Names are compared by their interned id from here on
+static symbol_t current_symbol() {
+    return current_kind() == TOKEN_NUMBER ? 0 : current_value()->symbol;
+}
+
+
+// Only resolved on errors, the lookup maps and indexes the file lazily
+static void print_token_location() {
+    if (locations)
+        srcmap_print(locations, token_offset(tokens, 0));
+}
 
 int expect_token(token_type_t type) {
-    if (current_token()->type == type) {
+    if (current_kind() == type) {
         advance_token();
         return 1;
     }
+    if (token_stream_failed(tokens))
+        return 0;
+
     print_backtrace();
-    fprintf(stderr, "Unexpected token: %d, while was expecting %d\n", current_token()->type, type);
+    fprintf(stderr, "Unexpected token: %d, while was expecting %d\n", current_kind(), type);
+    print_token_location();
     return 0;
 }
 
-// AST creation
-ASTNode* create_ast_node(ast_node_type_t type) {
-    ASTNode* node = (ASTNode*)calloc(1, sizeof(ASTNode));
-    node->type = type;
-    return node;
+// Children are only ever created before their parent, the tree is laid out
+// in post-order and nodes can be added whole
+static ast_index_t add_node(ast_node_t node) {
+    return ast_add_node(tree, node);
 }
 
-ASTNode* parse_block() {
-    expect_token(TOKEN_LBRACE);
-    ASTNode* block_node = create_ast_node(AST_BLOCK);
-    block_node->data.block.children = NULL;
-    block_node->data.block.child_count = 0;
-
-    while (current_token()->type != TOKEN_RBRACE) {
-        ASTNode* stmt = parse_statement();
-        block_node->data.block.children = realloc(
-            block_node->data.block.children,
-            sizeof(ASTNode*) * (block_node->data.block.child_count + 1)
-        );
-        block_node->data.block.children[block_node->data.block.child_count++] = stmt;
+// Children of the constructs still open are collected on one scratch stack
+// that lives across the whole parse. A construct remembers where its
+// children start and, once it closes, copies them into the AST's side
+// array of lists, so every child index is written twice at most.
+static struct {
+    ast_index_t* items;
+    size_t count;
+    size_t allocated;
+} scratch;
+
+static void push_child(ast_index_t child) {
+    if (scratch.count == scratch.allocated) {
+        scratch.allocated = scratch.allocated ? scratch.allocated * 2 : DEFAULT_SCRATCH_ALLOC;
+        scratch.items = (ast_index_t*)realloc(scratch.items, scratch.allocated * sizeof(ast_index_t));
     }
 
-    expect_token(TOKEN_RBRACE);
-    return block_node;
+    scratch.items[scratch.count++] = child;
 }
-ASTNode* parse_function_call() {
-    printf("parsing function call!\n");
-    ASTNode* node = create_ast_node(AST_FUNCTION_CALL);
 
-    // Parse function name
-    node->data.function_call.name = create_ast_node(AST_IDENTIFIER);
-    node->data.function_call.name->data.identifier = strdup(current_token()->value.str);
-    expect_token(TOKEN_IDENTIFIER);
+static ast_list_t pop_children(size_t base) {
+    ast_list_t list = ast_add_list(tree, scratch.items + base, scratch.count - base);
+    scratch.count = base;
+    return list;
+}
 
-    // Parse argument list
-    expect_token(TOKEN_LPAREN);
-    node->data.function_call.arguments = NULL;
-    node->data.function_call.arg_count = 0;
-
-    while (current_token()->type != TOKEN_RPAREN) {
-        ASTNode* arg = parse_expression();
-        node->data.function_call.arguments = realloc(
-            node->data.function_call.arguments,
-            sizeof(ASTNode*) * (node->data.function_call.arg_count + 1)
-        );
-        node->data.function_call.arguments[node->data.function_call.arg_count++] = arg;
-
-        if (current_token()->type == TOKEN_COMMA) {
-            advance_token();
-        } else {
+// Constructs still open, innermost last: blocks and the statements that
+// own them, operators waiting for their right operand, parentheses and
+// calls waiting for their ')'. They live here instead of on the C stack,
+// so the nesting depth is bounded by the heap only.
+typedef enum PARSE_FRAME_TYPE {
+    FRAME_PROGRAM,      // statements up to the end of the input
+    FRAME_BLOCK,        // statements up to '}'
+    FRAME_FUNCTION,     // the block above is the body
+    FRAME_IF,           // the block above is the then branch
+    FRAME_ELSE,         // the block above is the else branch
+    FRAME_WHILE,        // the block above is the body
+    FRAME_OPERATOR,     // the left operand is on the scratch stack
+    FRAME_PAREN,
+    FRAME_CALL,         // the arguments so far are on the scratch stack
+} parse_frame_type_t;
+
+typedef struct parse_frame {
+    uint8_t type;                   // parse_frame_type_t
+    uint8_t op;                     // operators: token_type_t
+    symbol_t name;                  // functions and calls
+    size_t base;                    // blocks and calls: first child on the scratch stack
+    ast_list_t parameters;
+    ast_index_t condition;
+    ast_index_t then_branch;
+} parse_frame_t;
+
+static struct {
+    parse_frame_t* items;
+    size_t count;
+    size_t allocated;
+} frames;
+
+static void push_frame(parse_frame_t frame) {
+    if (frames.count == frames.allocated) {
+        frames.allocated = frames.allocated ? frames.allocated * 2 : DEFAULT_PARSE_FRAMES_ALLOC;
+        frames.items = (parse_frame_t*)realloc(frames.items, frames.allocated * sizeof(parse_frame_t));
+    }
+
+    frames.items[frames.count++] = frame;
+}
+
+// Only valid until the next push, the stack moves as it grows
+static parse_frame_t* top_frame() {
+    return &frames.items[frames.count - 1];
+}
+
+static void open_block() {
+    expect_token(TOKEN_LBRACE);
+    push_frame((parse_frame_t){ .type = FRAME_BLOCK, .base = scratch.count });
+}
+
+// A block ends at its '}'. The construct that owns it either goes on with
+// an else branch or is complete and becomes a statement of the block
+// around it.
+static void close_block() {
+    ast_list_t children = pop_children(top_frame()->base);
+    frames.count--;
+    expect_token(TOKEN_RBRACE);
+    ast_index_t block = add_node((ast_node_t){ .type = AST_BLOCK, .data.block.children = children });
+
+    parse_frame_t* owner = top_frame();
+    ast_index_t node = 0;
+
+    switch (owner->type) {
+        case FRAME_FUNCTION:
+            node = add_node((ast_node_t){ .type = AST_FUNCTION, .data.function = { owner->name, owner->parameters, block } });
+            break;
+        case FRAME_IF:
+            if (current_kind() == TOKEN_KW_else) {
+                advance_token();
+                owner->type = FRAME_ELSE;
+                owner->then_branch = block;
+                open_block();
+                return;
+            }
+            node = add_node((ast_node_t){ .type = AST_IF, .data.if_statement = { owner->condition, block, 0 } });
+            break;
+        case FRAME_ELSE:
+            node = add_node((ast_node_t){ .type = AST_IF, .data.if_statement = { owner->condition, owner->then_branch, block } });
+            break;
+        default:
+            node = add_node((ast_node_t){ .type = AST_WHILE, .data.while_statement = { owner->condition, block } });
             break;
-        }
     }
 
-    expect_token(TOKEN_RPAREN);
-    expect_token(TOKEN_SEMICOLON);
-    return node;
+    frames.count--;
+    push_child(node);
 }
 
-ASTNode* parse_asm()
+ast_index_t parse_asm()
 {
-    expect_token(TOKEN_KEYWORD); // asm
-    ASTNode* node = create_ast_node(AST_INLINE_ASM);
+    expect_token(TOKEN_KW_asm);
 
-    printf("parse asm\n");
+    LOG_TRACE(parser, "parsing asm");
 
     buf_writer_t writer = { writer.buf = (char*)calloc(DEFAULT_INLINE_ASM_ALLOC, sizeof(char)), .buf_len = DEFAULT_INLINE_ASM_ALLOC};
-    node->data.identifier = writer.buf;
 
-    while(current_token()->type != TOKEN_SEMICOLON)
+    while(current_kind() != TOKEN_SEMICOLON)
     {
-        bufcpy(&writer, current_token()->value.str);
+        if (current_kind() == TOKEN_NUMBER) {
+            char* number = 0;
+            asprintf(&number, "%ld", current_value()->number);
+            bufcpy(&writer, number);
+            free(number);
+        } else {
+            bufslice(&writer, token_spelling(token_text, token_offset(tokens, 0)), current_value()->length);
+        }
         bufcpy(&writer, " ");
-        // printf("adding %s\n", current_token()->value.str);
+        // printf("adding %.*s\n", current_value()->length, token_spelling(token_text, token_offset(tokens, 0)));
         advance_token();
     }
-    writer.buf[writer.cursor] = '\x00';
-    
+    uint32_t text = ast_add_asm(tree, writer.buf, writer.cursor);
+    free(writer.buf);
+
     expect_token(TOKEN_SEMICOLON);
-    return node;
+    return add_node((ast_node_t){ .type = AST_INLINE_ASM, .data.value = text });
 }
 
-ASTNode* parse_return()
+ast_index_t parse_return()
 {
-    expect_token(TOKEN_KEYWORD); // return
-    ASTNode* node = create_ast_node(AST_RETURN);
+    expect_token(TOKEN_KW_return);
 
-    node->data.return_statement.value = 0;
-    if (current_token()->type != TOKEN_SEMICOLON) 
-       node->data.return_statement.value = parse_expression();
+    ast_index_t value = 0;
+    if (current_kind() != TOKEN_SEMICOLON) 
+       value = parse_expression();
 
     expect_token(TOKEN_SEMICOLON);
-    return node;
+    return add_node((ast_node_t){ .type = AST_RETURN, .data.return_statement.value = value });
 }
 
+// import name; the module is compiled separately, its interface file is
+// loaded by the driver before translation
+ast_index_t parse_import()
+{
+    expect_token(TOKEN_KW_import);
 
-ASTNode* parse_statement() {
-    if (current_token()->type == TOKEN_KEYWORD) {
-        if (strcmp(current_token()->value.str, "var") == 0) 
-            return parse_declaration();
-
-        if (strcmp(current_token()->value.str, "func") == 0) 
-          return parse_function();
-
-        if (strcmp(current_token()->value.str, "if") == 0) 
-          return parse_if();
-
-        if (strcmp(current_token()->value.str, "while") == 0) 
-          return parse_while();
-
-        if (strcmp(current_token()->value.str, "asm") == 0) 
-          return parse_asm();
+    symbol_t name = current_symbol();
+    expect_token(TOKEN_IDENTIFIER);
 
-        if (strcmp(current_token()->value.str, "return") == 0) 
-          return parse_return();
+    expect_token(TOKEN_SEMICOLON);
+    return add_node((ast_node_t){ .type = AST_IMPORT, .data.symbol = name });
+}
 
+static void open_function();
+static void open_if();
+static void open_while();
+
+// Simple statements are parsed whole and become a child of the innermost
+// block. Of the ones owning a block only the head is parsed here, they stay
+// open on the frame stack until that block closes.
+static void parse_statement() {
+    switch (current_kind()) {
+        case TOKEN_KW_var:
+            push_child(parse_declaration());
+            break;
+        case TOKEN_KW_func:
+            open_function();
+            break;
+        case TOKEN_KW_if:
+            open_if();
+            break;
+        case TOKEN_KW_while:
+            open_while();
+            break;
+        case TOKEN_KW_asm:
+            push_child(parse_asm());
+            break;
+        case TOKEN_KW_return:
+            push_child(parse_return());
+            break;
+        case TOKEN_KW_import:
+            push_child(parse_import());
+            break;
+        default:
+            push_child(parse_expression());
+            break;
     }
-
-    return parse_expression();
 }
 
-ASTNode* parse_declaration() {
-    expect_token(TOKEN_KEYWORD); // 'var'
+ast_index_t parse_declaration() {
+    expect_token(TOKEN_KW_var);
 
-    ASTNode* node = create_ast_node(AST_DECLARATION);
-    node->data.declaration.identifier = create_ast_node(AST_IDENTIFIER);
-    node->data.declaration.identifier->data.identifier = strdup(current_token()->value.str);
+    symbol_t name = current_symbol();
     expect_token(TOKEN_IDENTIFIER);
 
-    if (current_token()->type == TOKEN_ASSIGN) {
+    ast_index_t initializer = 0;
+    if (current_kind() == TOKEN_ASSIGN) {
         advance_token();
-        printf("parsing expression to init var\n");
-        node->data.declaration.initializer = parse_expression();
+        LOG_TRACE(parser, "parsing expression to init var");
+        initializer = parse_expression();
     } else {
-        printf("skipping initializer\n");
-        node->data.declaration.initializer = NULL;
+        LOG_TRACE(parser, "skipping initializer");
     }
 
     expect_token(TOKEN_SEMICOLON);
-    fprintf(stderr, "parsed declaration\n");
-    return node;
+    LOG_TRACE(parser, "parsed declaration");
+    return add_node((ast_node_t){ .type = AST_DECLARATION, .data.declaration = { name, initializer } });
 }
 
-ASTNode* parse_function() {
-    expect_token(TOKEN_KEYWORD); // 'func'
+static void open_function() {
+    expect_token(TOKEN_KW_func);
 
-    ASTNode* node = create_ast_node(AST_FUNCTION);
-    node->data.function.name = create_ast_node(AST_IDENTIFIER);
-    node->data.function.name->data.identifier = strdup(current_token()->value.str);
+    symbol_t name = current_symbol();
     expect_token(TOKEN_IDENTIFIER);
 
     expect_token(TOKEN_LPAREN);
-    node->data.function.parameters = NULL;
-    node->data.function.param_count = 0;
+    size_t base = scratch.count;
 
-    while (current_token()->type != TOKEN_RPAREN) {
-        ASTNode* param = create_ast_node(AST_IDENTIFIER);
-        param->data.identifier = strdup(current_token()->value.str);
+    while (current_kind() != TOKEN_RPAREN) {
+        push_child(add_node((ast_node_t){ .type = AST_IDENTIFIER, .data.symbol = current_symbol() }));
         expect_token(TOKEN_IDENTIFIER);
 
-        node->data.function.parameters = realloc(
-            node->data.function.parameters,
-            sizeof(ASTNode*) * (node->data.function.param_count + 1)
-        );
-        node->data.function.parameters[node->data.function.param_count++] = param;
-
-        if (current_token()->type == TOKEN_COMMA) {
+        if (current_kind() == TOKEN_COMMA) {
             advance_token();
         } else {
             break;
         }
     }
 
+    ast_list_t parameters = pop_children(base);
     expect_token(TOKEN_RPAREN);
-    node->data.function.body = parse_block();
-    return node;
+    push_frame((parse_frame_t){ .type = FRAME_FUNCTION, .name = name, .parameters = parameters });
+    open_block();
 }
 
-ASTNode* parse_if() {
-    expect_token(TOKEN_KEYWORD); // 'if'
+static void open_if() {
+    expect_token(TOKEN_KW_if);
 
-    ASTNode* node = create_ast_node(AST_IF);
     expect_token(TOKEN_LPAREN);
-    node->data.if_statement.condition = parse_expression_priority();
+    ast_index_t condition = parse_binary();
     expect_token(TOKEN_RPAREN);
 
-    node->data.if_statement.then_branch = parse_block();
-
-    if (current_token()->type == TOKEN_KEYWORD && strcmp(current_token()->value.str, "else") == 0) {
-        advance_token();
-        node->data.if_statement.else_branch = parse_block();
-    } else {
-        node->data.if_statement.else_branch = NULL;
-    }
-
-    return node;
+    push_frame((parse_frame_t){ .type = FRAME_IF, .condition = condition });
+    open_block();
 }
 
-ASTNode* parse_while() {
-    expect_token(TOKEN_KEYWORD); // 'while'
+static void open_while() {
+    expect_token(TOKEN_KW_while);
 
-    ASTNode* node = create_ast_node(AST_WHILE);
     expect_token(TOKEN_LPAREN);
-    node->data.while_statement.condition = parse_expression();
+    ast_index_t condition = parse_expression();
     expect_token(TOKEN_RPAREN);
 
-    node->data.while_statement.body = parse_block();
-    return node;
+    push_frame((parse_frame_t){ .type = FRAME_WHILE, .condition = condition });
+    open_block();
 }
 
-ASTNode* parse_expression() {
-    if (current_token()->type == TOKEN_IDENTIFIER && tokens[token_index + 1].type == TOKEN_ASSIGN) {
-        printf("parsing assignment\n");
+ast_index_t parse_expression() {
+    if (current_kind() == TOKEN_IDENTIFIER && token_kind(tokens, 1) == TOKEN_ASSIGN) {
+        LOG_TRACE(parser, "parsing assignment");
         return parse_assignment();
     }
 
-    return parse_expression_priority();
+    return parse_binary();
 }
 
-ASTNode* parse_assignment() {
-    ASTNode* node = create_ast_node(AST_ASSIGNMENT);
-
+ast_index_t parse_assignment() {
     // Parse left-hand side (identifier)
-    node->data.assignment.left = create_ast_node(AST_IDENTIFIER);
-    node->data.assignment.left->data.identifier = strdup(current_token()->value.str);
+    symbol_t name = current_symbol();
     expect_token(TOKEN_IDENTIFIER);
 
     expect_token(TOKEN_ASSIGN);
 
     // Parse right-hand side (expression)
-    node->data.assignment.right = parse_expression_priority();
+    ast_index_t value = parse_binary();
 
     expect_token(TOKEN_SEMICOLON);
-    fprintf(stderr, "parsed assignment\n");
-    return node;
+    LOG_TRACE(parser, "parsed assignment");
+    return add_node((ast_node_t){ .type = AST_ASSIGNMENT, .data.assignment = { name, value } });
 }
-ASTNode* parse_primary() 
+// Numbers and names, parentheses and calls are frames of parse_binary()
+static ast_index_t parse_operand() 
 {
-    if (current_token()->type == TOKEN_NUMBER) {
-        ASTNode* node = create_ast_node(AST_NUMBER);
-        node->data.number = current_token()->value.number;
+    if (current_kind() == TOKEN_NUMBER) {
+        uint32_t number = ast_add_number(tree, current_value()->number);
         advance_token();
-        return node;
+        return add_node((ast_node_t){ .type = AST_NUMBER, .data.value = number });
     } 
 
-    if (current_token()->type == TOKEN_IDENTIFIER) {
-        // Lookahead to check if this is a function call
-        if (tokens[token_index + 1].type == TOKEN_LPAREN) {
-            return parse_function_call();
-        }
-
-        ASTNode* node = create_ast_node(AST_IDENTIFIER);
-        node->data.identifier = strdup(current_token()->value.str);
+    if (current_kind() == TOKEN_IDENTIFIER) {
+        ast_index_t node = add_node((ast_node_t){ .type = AST_IDENTIFIER, .data.symbol = current_symbol() });
         advance_token();
         return node;
     }
 
-    if (current_token()->type == TOKEN_IDENTIFIER) {
-        ASTNode* node = create_ast_node(AST_IDENTIFIER);
-        node->data.identifier = strdup(current_token()->value.str);
-        advance_token();
-        return node;
-    } 
-
-    if (current_token()->type == TOKEN_LPAREN) {
-        advance_token(); // Consume '('
-        ASTNode* expr = parse_expression_priority();
-        if (current_token()->type != TOKEN_RPAREN) {
-            fprintf(stderr, "Expected ')' after expression\n");
-            return 0;
-        }
-        advance_token(); // Consume ')'
-        return expr;
-    } 
+    // the error that cut the tokens short has been reported already
+    if (token_stream_failed(tokens))
+        exit(1);
 
     print_backtrace();
 
-    fprintf(stderr, "Unexpected token in primary: Type=%d, Value=%s\n", 
-                current_token()->type, 
-                current_token()->type == TOKEN_KEYWORD || current_token()->type == TOKEN_IDENTIFIER
-                ? current_token()->value.str 
-                : "N/A");
+    int named = current_kind() != TOKEN_NUMBER && current_kind() != TOKEN_EOF;
+    fprintf(stderr, "Unexpected token in primary: Type=%d, Value=%.*s\n", 
+                current_kind(), 
+                named ? (int)current_value()->length : 3,
+                named ? token_spelling(token_text, token_offset(tokens, 0)) : "N/A");
+    print_token_location();
     exit(1);
     return 0;
 }
-// Utility for freeing the AST
-void free_ast(ASTNode* node) {
-    if (!node) return;
 
-    switch (node->type) {
-        case AST_NUMBER:
-            break;
-        case AST_IDENTIFIER:
-            free(node->data.identifier);
-            break;
-        case AST_ASSIGNMENT:
-            free_ast(node->data.assignment.left);
-            free_ast(node->data.assignment.right);
-            break;
-        case AST_DECLARATION:
-            free_ast(node->data.declaration.identifier);
-            free_ast(node->data.declaration.initializer);
-            break;
-        case AST_FUNCTION:
-            free_ast(node->data.function.name);
-            for (size_t i = 0; i < node->data.function.param_count; ++i) {
-                free_ast(node->data.function.parameters[i]);
-            }
-            free(node->data.function.parameters);
-            free_ast(node->data.function.body);
-            break;
-        case AST_IF:
-            free_ast(node->data.if_statement.condition);
-            free_ast(node->data.if_statement.then_branch);
-            free_ast(node->data.if_statement.else_branch);
-            break;
-        case AST_WHILE:
-            free_ast(node->data.while_statement.condition);
-            free_ast(node->data.while_statement.body);
-            break;
-        case AST_BLOCK:
-            for (size_t i = 0; i < node->data.block.child_count; ++i) {
-                free_ast(node->data.block.children[i]);
-            }
-            free(node->data.block.children);
-            break;
-        case AST_PROGRAM:
-            for (size_t i = 0; i < node->data.program.child_count; ++i) {
-                free_ast(node->data.program.children[i]);
-            }
-            free(node->data.program.children);
-            break;
-        default:
-            break;
-    }
+// Fills ast, which the caller has initialized, and returns the program
+// node, its root. Only the scratch and frame stacks are the parser's own.
+ast_index_t parse_program(token_stream_t* stream, const token_text_t* text, srcmap_t* map, ast_t* ast) 
+{
+	tokens = stream;
+	tree = ast;
+	token_text = text;
+	locations = map;
+
+	push_frame((parse_frame_t){ .type = FRAME_PROGRAM, .base = scratch.count });
+
+	while (frames.count)
+	{
+		parse_frame_t* frame = top_frame();
+
+		if (frame->type == FRAME_PROGRAM && current_kind() == TOKEN_EOF)
+		{
+			ast_list_t children = pop_children(frame->base);
+			frames.count--;
+			ast->root = add_node((ast_node_t){ .type = AST_PROGRAM, .data.block.children = children });
+		}
+		else if (frame->type == FRAME_BLOCK && current_kind() == TOKEN_RBRACE)
+			close_block();
+		else
+			parse_statement();
+	}
 
-    free(node);
+	free(scratch.items);
+	scratch.items = NULL;
+	scratch.allocated = 0;
+	free(frames.items);
+	frames.items = NULL;
+	frames.allocated = 0;
+	return ast->root;
 }
 
+static ast_index_t create_binary_op_node(ast_index_t left, token_type_t op, ast_index_t right) {
+    return add_node((ast_node_t){ .type = AST_BINARY, .op = op, .data.binary_op = { left, right } });
+}
 
-ASTNode* parse_program(token_t* t) 
-{
-	tokens = t;
-	token_index = 0;
-
-	ASTNode* program_node = create_ast_node(AST_PROGRAM);
-	program_node->data.program.children = NULL;
-	program_node->data.program.child_count = 0;
-
-	while (current_token()->type != TOKEN_EOF) {
-		ASTNode* stmt = parse_statement();
-		program_node->data.program.children = realloc(
-			program_node->data.program.children,
-			sizeof(ASTNode*) * (program_node->data.program.child_count + 1)
-		);
-		program_node->data.program.children[program_node->data.program.child_count++] = stmt;
-	}
+// How tightly each binary operator holds its operands, 0 for every token
+// that is not one. All of them are left associative, a new operator only
+// needs its entry here.
+static const uint8_t BINDING_POWER[TOKEN_TYPE_CNT] = {
+    [TOKEN_GREATER]   = 1,
+    [TOKEN_LESS]      = 1,
+    [TOKEN_EQUALS]    = 1,
+
+    [TOKEN_CARET]     = 2,
+    [TOKEN_AMPERSAND] = 2,
+    [TOKEN_BAR]       = 2,
+
+    [TOKEN_PLUS]      = 3,
+    [TOKEN_MINUS]     = 3,
+
+    [TOKEN_STAR]      = 4,
+    [TOKEN_SLASH]     = 4,
+};
+
+// Pops the operators above bottom that bind at least as tightly as power
+// into nodes, which keeps all of them left associative
+static void fold_operators(size_t bottom, uint8_t power) {
+    while (frames.count > bottom && top_frame()->type == FRAME_OPERATOR && BINDING_POWER[top_frame()->op] >= power) {
+        ast_index_t right = scratch.items[--scratch.count];
+        ast_index_t left = scratch.items[--scratch.count];
+        push_child(create_binary_op_node(left, (token_type_t)top_frame()->op, right));
+        frames.count--;
+    }
+}
 
-	return program_node;
+static void close_call() {
+    parse_frame_t call = frames.items[--frames.count];
+    ast_list_t arguments = pop_children(call.base);
+    expect_token(TOKEN_RPAREN);
+    expect_token(TOKEN_SEMICOLON);
+    push_child(add_node((ast_node_t){ .type = AST_FUNCTION_CALL, .data.function_call = { call.name, arguments } }));
 }
 
-static ASTNode* create_binary_op_node(ASTNode* left, token_type_t op, ASTNode* right) {
-    ASTNode* node = create_ast_node(AST_BINARY);
-    node->data.binary_op.left = left;
-    node->data.binary_op.op = op;
-    node->data.binary_op.right = right;
-    return node;
+typedef enum EXPRESSION_STATE {
+    EXPECT_OPERAND,
+    EXPECT_OPERATOR,        // or the end of the innermost parenthesis, argument or expression
+    EXPECT_ARGUMENT,        // or the ')' of the call
+    ARGUMENT_DONE,
+} expression_state_t;
+
+// Operator precedence on explicit stacks: operands go on the scratch stack,
+// operators, parentheses and calls on the frame stack. An operator first
+// folds the ones before it that bind at least as tightly, the end of a
+// parenthesis, an argument or the expression folds the rest. An operand
+// that is not followed by an operator costs one table lookup.
+static ast_index_t parse_binary() {
+    size_t bottom = frames.count;
+    expression_state_t state = EXPECT_OPERAND;
+
+    for (;;) {
+        switch (state) {
+            case EXPECT_OPERAND:
+                if (current_kind() == TOKEN_LPAREN) {
+                    advance_token();
+                    push_frame((parse_frame_t){ .type = FRAME_PAREN });
+                } else if (current_kind() == TOKEN_IDENTIFIER && token_kind(tokens, 1) == TOKEN_LPAREN) {
+                    LOG_TRACE(parser, "parsing function call");
+                    push_frame((parse_frame_t){ .type = FRAME_CALL, .name = current_symbol(), .base = scratch.count });
+                    advance_token();
+                    advance_token();
+                    state = EXPECT_ARGUMENT;
+                } else {
+                    push_child(parse_operand());
+                    state = EXPECT_OPERATOR;
+                }
+                break;
+
+            case EXPECT_ARGUMENT:
+                if (current_kind() == TOKEN_RPAREN) {
+                    close_call();
+                    state = EXPECT_OPERATOR;
+                } else if (current_kind() == TOKEN_IDENTIFIER && token_kind(tokens, 1) == TOKEN_ASSIGN) {
+                    // the only way back into parse_binary(), one level per assignment
+                    push_child(parse_assignment());
+                    state = ARGUMENT_DONE;
+                } else
+                    state = EXPECT_OPERAND;
+                break;
+
+            case ARGUMENT_DONE:
+                if (current_kind() == TOKEN_COMMA) {
+                    advance_token();
+                    state = EXPECT_ARGUMENT;
+                } else {
+                    close_call();
+                    state = EXPECT_OPERATOR;
+                }
+                break;
+
+            case EXPECT_OPERATOR: {
+                uint8_t power = BINDING_POWER[current_kind()];
+                if (power) {
+                    fold_operators(bottom, power);
+                    push_frame((parse_frame_t){ .type = FRAME_OPERATOR, .op = (uint8_t)current_kind() });
+                    advance_token();
+                    state = EXPECT_OPERAND;
+                    break;
+                }
+
+                fold_operators(bottom, 0);
+                if (frames.count == bottom)
+                    return scratch.items[--scratch.count];
+
+                if (top_frame()->type == FRAME_CALL) {
+                    state = ARGUMENT_DONE;
+                    break;
+                }
+
+                frames.count--;
+                if (current_kind() == TOKEN_RPAREN)
+                    advance_token();
+                else if (!token_stream_failed(tokens)) {
+                    fprintf(stderr, "Expected ')' after expression\n");
+                    print_token_location();
+                }
+                break;
+            }
+        }
+    }
 }
 
-#define PARSE(NAME, CONDITION, NEXT)                                                        \
-ASTNode* NAME() {                                                                           \
-    ASTNode* node = NEXT();                                                                 \
-    if(!node) return 0;                                                                     \
-    while (CONDITION) {                                                                     \
-        token_type_t op = current_token()->type;                                            \
-        advance_token();                                                                    \
-        ASTNode* right = NEXT();                                                            \
-        node = create_binary_op_node(node, op, right);                                      \
-    }                                                                                       \
-    return node;                                                                            \
-}                                                                                           \
-
-
-PARSE(parse_term,       current_token()->type == TOKEN_STAR || current_token()->type == TOKEN_SLASH,    parse_primary)
-
-PARSE(parse_math_expr,  current_token()->type == TOKEN_PLUS || current_token()->type == TOKEN_MINUS,    parse_term)
-
-PARSE(parse_logic_expr, current_token()->type == TOKEN_CARET || current_token()->type == TOKEN_AMPERSAND
-                        || current_token()->type == TOKEN_BAR,                                          parse_math_expr)
-
-PARSE(parse_expression_priority, current_token()->type == TOKEN_GREATER || current_token()->type == TOKEN_LESS 
-                        || current_token()->type == TOKEN_EQUALS,                                           parse_logic_expr)
-
-
-// static ASTNode* parse_term() {
-//     ASTNode* node = parse_primary();
-//     if(!node) return 0;
-//
-//     while (current_token()->type == TOKEN_STAR || current_token()->type == TOKEN_SLASH) {
-//         token_type_t op = current_token()->type;
-//         advance_token(); // Consume operator
-//         ASTNode* right = parse_primary();
-//         node = create_binary_op_node(node, op, right);
-//     }
-//     return node;
-// }
-//
-// ASTNode* parse_math_expr() 
-// {
-//     ASTNode* node = parse_term();
-//     if(!node) return 0;
-//
-//     while (current_token()->type == TOKEN_PLUS || current_token()->type == TOKEN_MINUS) {
-//         token_type_t op = current_token()->type;
-//         advance_token(); // Consume operator
-//         ASTNode* right = parse_term();
-//         node = create_binary_op_node(node, op, right);
-//     }
-//     return node;
-// }
-//
-// ASTNode* parse_logic_expr() 
-// {
-//     ASTNode* node = parse_math_expr();
-//     if(!node) return 0;
-//
-//     while (current_token()->type == TOKEN_GREATER || current_token()->type == TOKEN_LESS || current_token()->type == TOKEN_EQ) {
-//         token_type_t op = current_token()->type;
-//         advance_token(); // Consume operator
-//         ASTNode* right = parse_math_expr();
-//         node = create_binary_op_node(node, op, right);
-//     }
-//     return node;
-// }
-//
-
-
-
-void serialize_ast(ASTNode* ast)
+
+void serialize_ast(const ast_t* ast)
 {
 }
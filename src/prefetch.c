@@ -0,0 +1,222 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "prefetch.h"
+#include "preprocessor.h"
+#include "fs.h"
+
+// Includes are opened, mapped and faulted in by a small pool while the
+// preprocessor is still busy splicing earlier files. Splicing itself stays
+// sequential, the pool only moves I/O latency off the critical path.
+
+static void load_job(prefetcher_t* pf, const char* path, int* status, struct stat* st, mapped_file_t* source)
+{
+	*status = stat(path, st);
+	if (!*status)
+		*status = map_file(path, source);
+
+	if (*status || !source->data)
+		return;
+
+	madvise(source->data, source->size, MADV_WILLNEED);
+
+	// scanning faults the pages in and queues the next level of includes
+	prefetch_scan(pf, source->data, source->size);
+}
+
+static void finish_job(prefetcher_t* pf, size_t job_idx, int status, const struct stat* st, const mapped_file_t* source)
+{
+	prefetch_job_t* job = &pf->jobs[job_idx];
+	job->status = status;
+	job->st = *st;
+	job->source = *source;
+	job->state = PREFETCH_DONE;
+
+	pthread_cond_broadcast(&pf->done);
+}
+
+static void* prefetch_worker(void* arg)
+{
+	prefetcher_t* pf = (prefetcher_t*)arg;
+
+	pthread_mutex_lock(&pf->lock);
+	while (!pf->stop)
+	{
+		if (pf->next_job >= pf->job_cnt)
+		{
+			pthread_cond_wait(&pf->queued, &pf->lock);
+			continue;
+		}
+
+		size_t job_idx = pf->next_job++;
+		if (pf->jobs[job_idx].state != PREFETCH_QUEUED)
+			continue;
+
+		pf->jobs[job_idx].state = PREFETCH_RUNNING;
+		const char* path = pf->jobs[job_idx].path;
+		pthread_mutex_unlock(&pf->lock);
+
+		struct stat st = {0};
+		mapped_file_t source = {0};
+		int status = 0;
+		load_job(pf, path, &status, &st, &source);
+
+		pthread_mutex_lock(&pf->lock);
+		finish_job(pf, job_idx, status, &st, &source);
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	return 0;
+}
+
+static ssize_t find_job(prefetcher_t* pf, const char* path, size_t len)
+{
+	uintptr_t found = (uintptr_t)hashtable_get(&pf->job_ids, path, len);
+	return found ? (ssize_t)found - 1 : -1;
+}
+
+void prefetch_init(prefetcher_t* pf, size_t thread_cnt, struct include_resolver* resolver)
+{
+	*pf = (prefetcher_t){ .resolver = resolver };
+	pf->thread_cnt = thread_cnt < MAX_PREFETCH_THREADS ? thread_cnt : MAX_PREFETCH_THREADS;
+
+	hashtable_init(&pf->job_ids, DEFAULT_HASHTABLE_CAPACITY);
+	pthread_mutex_init(&pf->lock, 0);
+	pthread_cond_init(&pf->queued, 0);
+	pthread_cond_init(&pf->done, 0);
+}
+
+void prefetch_submit(prefetcher_t* pf, const char* path, size_t len)
+{
+	if (!pf->thread_cnt)
+		return;
+
+	pthread_mutex_lock(&pf->lock);
+
+	if (find_job(pf, path, len) >= 0)
+	{
+		pthread_mutex_unlock(&pf->lock);
+		return;
+	}
+
+	if (pf->job_cnt + 1 >= pf->jobs_allocated)
+	{
+		pf->jobs_allocated = pf->jobs_allocated ? pf->jobs_allocated * 2 : DEFAULT_PREFETCH_JOBS_ALLOC;
+		pf->jobs = (prefetch_job_t*)realloc(pf->jobs, pf->jobs_allocated * sizeof(prefetch_job_t));
+	}
+
+	// the key is the job's own copy of the path, which stays put as jobs grows
+	pf->jobs[pf->job_cnt] = (prefetch_job_t){ .path = strndup(path, len), .state = PREFETCH_QUEUED };
+	hashtable_set(&pf->job_ids, pf->jobs[pf->job_cnt].path, len, (void*)(uintptr_t)(pf->job_cnt + 1));
+	pf->job_cnt++;
+
+	// threads only come up once there is something to fetch
+	if (pf->threads_started < pf->thread_cnt && pf->threads_started < pf->job_cnt - pf->next_job)
+	{
+		if (!pthread_create(&pf->threads[pf->threads_started], 0, prefetch_worker, pf))
+			pf->threads_started++;
+	}
+
+	pthread_cond_signal(&pf->queued);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+void prefetch_scan(prefetcher_t* pf, const char* data, size_t size)
+{
+	if (!pf->thread_cnt)
+		return;
+
+	const char *cursor = data, *end = data + size;
+
+	while (cursor < end)
+	{
+		const char *newline = memchr(cursor, '\n', end - cursor);
+		const char *line_end = newline ? newline : end;
+
+		const char* name = 0;
+		size_t name_len = 0;
+		const char* path = 0;
+		if (parse_include(cursor, line_end - cursor, &name, &name_len) && (path = resolve_include(pf->resolver, name, name_len)))
+			prefetch_submit(pf, path, strlen(path));
+
+		cursor = line_end + 1;
+	}
+}
+
+// Hands over the result for a path that was submitted earlier, waiting for
+// it or loading it on the spot if no worker picked it up yet. Returns false
+// if the path was never submitted or has already been taken.
+bool prefetch_take(prefetcher_t* pf, const char* path, struct stat* st, mapped_file_t* source, int* status)
+{
+	if (!pf->thread_cnt)
+		return false;
+
+	pthread_mutex_lock(&pf->lock);
+
+	ssize_t job_idx = find_job(pf, path, strlen(path));
+	if (job_idx < 0 || pf->jobs[job_idx].state == PREFETCH_TAKEN)
+	{
+		pthread_mutex_unlock(&pf->lock);
+		return false;
+	}
+
+	if (pf->jobs[job_idx].state == PREFETCH_QUEUED)
+	{
+		pf->jobs[job_idx].state = PREFETCH_RUNNING;
+		pthread_mutex_unlock(&pf->lock);
+
+		struct stat job_st = {0};
+		mapped_file_t job_source = {0};
+		int job_status = 0;
+		load_job(pf, path, &job_status, &job_st, &job_source);
+
+		pthread_mutex_lock(&pf->lock);
+		finish_job(pf, job_idx, job_status, &job_st, &job_source);
+	}
+
+	while (pf->jobs[job_idx].state != PREFETCH_DONE)
+		pthread_cond_wait(&pf->done, &pf->lock);
+
+	prefetch_job_t* job = &pf->jobs[job_idx];
+	*st = job->st;
+	*source = job->source;
+	*status = job->status;
+
+	job->source = (mapped_file_t){0};
+	job->state = PREFETCH_TAKEN;
+
+	pthread_mutex_unlock(&pf->lock);
+	return true;
+}
+
+void prefetch_free(prefetcher_t* pf)
+{
+	pthread_mutex_lock(&pf->lock);
+	pf->stop = true;
+	pthread_cond_broadcast(&pf->queued);
+	pthread_mutex_unlock(&pf->lock);
+
+	for (size_t i = 0; i < pf->threads_started; i++)
+		pthread_join(pf->threads[i], 0);
+
+	// anything fetched but never spliced in is still mapped here
+	for (size_t i = 0; i < pf->job_cnt; i++)
+	{
+		unmap_file(&pf->jobs[i].source);
+		free(pf->jobs[i].path);
+	}
+
+	free(pf->jobs);
+	hashtable_free(&pf->job_ids);
+
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->queued);
+	pthread_cond_destroy(&pf->done);
+
+	*pf = (prefetcher_t){0};
+}
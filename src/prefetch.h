@@ -0,0 +1,62 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+#include "hashtable.h"
+
+#define MAX_PREFETCH_THREADS 32
+
+static const size_t DEFAULT_PREFETCH_THREADS = 4;
+static const size_t DEFAULT_PREFETCH_JOBS_ALLOC = 16;
+
+typedef enum PREFETCH_STATE
+{
+	PREFETCH_QUEUED,
+	PREFETCH_RUNNING,
+	PREFETCH_DONE,
+	PREFETCH_TAKEN,
+} prefetch_state_t;
+
+typedef struct prefetch_job
+{
+	char* path;
+	prefetch_state_t state;
+
+	int status;
+	struct stat st;
+	mapped_file_t source;
+} prefetch_job_t;
+
+struct include_resolver;
+
+typedef struct prefetcher
+{
+	struct include_resolver* resolver;
+
+	pthread_t threads[MAX_PREFETCH_THREADS];
+	size_t thread_cnt;
+	size_t threads_started;
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+
+	// jobs are never removed, the array doubles as the set of requested paths
+	prefetch_job_t* jobs;
+	size_t job_cnt;
+	size_t jobs_allocated;
+	size_t next_job;
+	hashtable_t job_ids;	// path -> index in jobs + 1
+
+	bool stop;
+} prefetcher_t;
+
+void prefetch_init(prefetcher_t* pf, size_t thread_cnt, struct include_resolver* resolver);
+void prefetch_submit(prefetcher_t* pf, const char* path, size_t len);
+void prefetch_scan(prefetcher_t* pf, const char* data, size_t size);
+bool prefetch_take(prefetcher_t* pf, const char* path, struct stat* st, mapped_file_t* source, int* status);
+void prefetch_free(prefetcher_t* pf);
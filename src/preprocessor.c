@@ -1,79 +1,886 @@
 #include <stdio.h>
 #include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "preprocessor.h"
 #include "io.h"
+#include "fs.h"
 #include "buffer.h"
 #include "lexer.h"
+#include "macro.h"
+#include "hashtable.h"
+#include "depfile.h"
 
+static const char* DIRECTIVE_NAMES[] = {
+	[DIRECTIVE_UNKNOWN] = "",
+#define DIRECTIVE(NAME)	[DIRECTIVE_##NAME] = #NAME,
+	DIRECTIVES
+#undef DIRECTIVE
+};
 
-static int process_file(const char *file_path, int depth, buf_writer_t *writer);
+static int process_file(preprocessor_t *pp, const char *file_path, size_t depth);
 
-static void strip_comments(char *line) 
+static size_t strip_comments(const char *line, size_t len) 
 {
-	char *comment_start = strstr(line, "//");
-	if (comment_start) 
-		*comment_start = '\0';
+	const char *end = line + len;
+	const char *slash = line;
+
+	while ((slash = memchr(slash, '/', end - slash)) && slash + 1 < end)
+	{
+		if (slash[1] == '/')
+			return slash - line;
+		slash++;
+	}
+
+	return len;
+}
+
+static const char* skip_blanks(const char *cursor, const char *end)
+{
+	while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+		cursor++;
+	return cursor;
+}
+
+static bool is_blank(const char *line, size_t len)
+{
+	return skip_blanks(line, line + len) == line + len;
+}
+
+// Recognizes "#name args", the arguments are left as a slice of the line
+directive_t parse_directive(const char *line, size_t len, const char **args, size_t *args_len)
+{
+	const char *end = line + len;
+	if (!len || *line != '#')
+		return DIRECTIVE_UNKNOWN;
+
+	const char *name = line + 1;
+	const char *name_end = name;
+	while (name_end < end && is_ident_char(*name_end))
+		name_end++;
+
+	*args = skip_blanks(name_end, end);
+	*args_len = end - *args;
+
+	for (size_t i = DIRECTIVE_UNKNOWN + 1; i < sizeof(DIRECTIVE_NAMES) / sizeof(*DIRECTIVE_NAMES); i++)
+	{
+		if (strlen(DIRECTIVE_NAMES[i]) == (size_t)(name_end - name) && strncmp(DIRECTIVE_NAMES[i], name, name_end - name) == 0)
+			return (directive_t)i;
+	}
+
+	return DIRECTIVE_UNKNOWN;
+}
+
+// Finds the quoted file name of an #include line, the name is left as a
+// slice of the line
+bool parse_include(const char *line, size_t len, const char **name, size_t *name_len)
+{
+	const char *start = 0;
+	size_t args_len = 0;
+
+	if (parse_directive(line, len, &start, &args_len) != DIRECTIVE_include)
+		return false;
+
+	const char *end = start + args_len;
+	if (start >= end || *start != '"')
+		return false;
+
+	start++;
+	const char *name_end = memchr(start, '"', end - start);
+	if (!name_end)
+		return false;
+
+	*name = start;
+	*name_len = name_end - start;
+	return true;
+}
+
+static const char* read_macro_name(const char *args, size_t args_len, size_t *name_len)
+{
+	size_t len = 0;
+	while (len < args_len && is_ident_char(args[len]))
+		len++;
+
+	*name_len = len;
+	return len ? args : 0;
+}
+
+static bool is_active(const preprocessor_t *pp)
+{
+	return !pp->cond_cnt || pp->conds[pp->cond_cnt - 1].active;
+}
+
+static void push_conditional(preprocessor_t *pp, bool taken)
+{
+	if (pp->cond_cnt + 1 >= pp->conds_allocated)
+	{
+		pp->conds_allocated *= 2;
+		pp->conds = (conditional_t*)realloc(pp->conds, pp->conds_allocated * sizeof(conditional_t));
+	}
+
+	bool parent_active = is_active(pp);
+	pp->conds[pp->cond_cnt++] = (conditional_t){ .active = parent_active && taken, .parent_active = parent_active };
 }
 
-static int process_line(char *line, int depth, buf_writer_t *writer) 
+static dir_listing_t* list_dir(include_resolver_t *resolver, const char *dir, size_t dir_len)
 {
-	strip_comments(line);
+	dir_listing_t *listing = (dir_listing_t*)hashtable_get(&resolver->listings, dir, dir_len);
+	if (listing)
+		return listing;
+
+	listing = (dir_listing_t*)calloc(1, sizeof(dir_listing_t));
+	listing->names_allocated = DEFAULT_DIR_LISTING_ALLOC;
+	listing->names = (char**)calloc(listing->names_allocated, sizeof(char*));
+	listing->dir = strndup(dir, dir_len);
+	hashtable_init(&listing->entries, DEFAULT_DIR_LISTING_ALLOC);
+
+	DIR *handle = opendir(listing->dir);
+	struct dirent *entry = 0;
 
-	if (strncmp(line, "#include", 8) == 0) 
+	// a directory that does not exist simply lists as empty
+	while (handle && (entry = readdir(handle)))
 	{
-		char include_file[256];
-		if (sscanf(line + 8, " \"%[^\"]\"", include_file) == 1) 
+		if (entry->d_type == DT_DIR)
+			continue;
+
+		if (listing->name_cnt + 1 >= listing->names_allocated)
 		{
-			process_file(include_file, depth + 1, writer);
-		} else {
-			print_error("Malformed #include statement");
-			return 1;
+			listing->names_allocated *= 2;
+			listing->names = (char**)realloc(listing->names, listing->names_allocated * sizeof(char*));
 		}
+
+		char *name = strdup(entry->d_name);
+		listing->names[listing->name_cnt++] = name;
+		hashtable_set(&listing->entries, name, strlen(name), name);
+	}
+
+	if (handle)
+		closedir(handle);
+
+	hashtable_set(&resolver->listings, listing->dir, dir_len, listing);
+
+	return listing;
+}
+
+static bool candidate_exists(include_resolver_t *resolver, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	const char *base = slash ? slash + 1 : path;
+
+	const char *dir = slash ? path : ".";
+	size_t dir_len = slash ? (size_t)(slash - path) : 1;
+	if (slash == path)
+		dir_len = 1;
+
+	dir_listing_t *listing = list_dir(resolver, dir, dir_len);
+	return hashtable_get(&listing->entries, base, strlen(base)) != 0;
+}
+
+void resolver_init(include_resolver_t *resolver)
+{
+	*resolver = (include_resolver_t){0};
+	hashtable_init(&resolver->resolved, DEFAULT_HASHTABLE_CAPACITY);
+	hashtable_init(&resolver->listings, DEFAULT_HASHTABLE_CAPACITY);
+	pthread_mutex_init(&resolver->lock, 0);
+}
+
+void resolver_add_dir(include_resolver_t *resolver, const char *dir)
+{
+	if (resolver->dir_cnt + 1 >= resolver->dirs_allocated)
+	{
+		resolver->dirs_allocated = resolver->dirs_allocated ? resolver->dirs_allocated * 2 : DEFAULT_DIR_LISTING_ALLOC;
+		resolver->dirs = (char**)realloc(resolver->dirs, resolver->dirs_allocated * sizeof(char*));
+	}
+
+	// "dir/" and "dir" name the same place, keep candidates tidy
+	size_t len = strlen(dir);
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+
+	resolver->dirs[resolver->dir_cnt++] = strndup(dir, len);
+}
+
+// Looks for the include relative to the working directory first, then in
+// every search directory in order. Returns NULL if there is no such file.
+const char* resolve_include(include_resolver_t *resolver, const char *name, size_t len)
+{
+	pthread_mutex_lock(&resolver->lock);
+
+	resolved_include_t *resolved = (resolved_include_t*)hashtable_get(&resolver->resolved, name, len);
+	if (resolved)
+	{
+		pthread_mutex_unlock(&resolver->lock);
+		return resolved->path;
+	}
+
+	resolved = (resolved_include_t*)calloc(1, sizeof(resolved_include_t));
+	resolved->name = strndup(name, len);
+
+	if (candidate_exists(resolver, resolved->name))
+		resolved->path = strdup(resolved->name);
+
+	else if (resolved->name[0] != '/')
+		resolved->probed = (char**)calloc(resolver->dir_cnt + 1, sizeof(char*));
+
+	// the misses are kept, a file appearing at any of them changes the result
+	if (resolved->probed)
+		resolved->probed[resolved->probed_cnt++] = strdup(resolved->name);
+
+	for (size_t i = 0; i < resolver->dir_cnt && !resolved->path && resolved->name[0] != '/'; i++)
+	{
+		char *candidate = 0;
+		asprintf(&candidate, "%s/%s", resolver->dirs[i], resolved->name);
+
+		if (candidate_exists(resolver, candidate))
+			resolved->path = candidate;
+		else
+			resolved->probed[resolved->probed_cnt++] = candidate;
+	}
+
+	hashtable_set(&resolver->resolved, resolved->name, len, resolved);
+	pthread_mutex_unlock(&resolver->lock);
+
+	return resolved->path;
+}
+
+void resolver_free(include_resolver_t *resolver)
+{
+	for (size_t i = 0; i < resolver->resolved.capacity; i++)
+	{
+		resolved_include_t *resolved = (resolved_include_t*)resolver->resolved.entries[i].value;
+		if (!resolved)
+			continue;
+
+		for (size_t j = 0; j < resolved->probed_cnt; j++)
+			free(resolved->probed[j]);
+
+		free(resolved->probed);
+		free(resolved->name);
+		free(resolved->path);
+		free(resolved);
+	}
+
+	for (size_t i = 0; i < resolver->listings.capacity; i++)
+	{
+		dir_listing_t *listing = (dir_listing_t*)resolver->listings.entries[i].value;
+		if (!listing)
+			continue;
+
+		for (size_t j = 0; j < listing->name_cnt; j++)
+			free(listing->names[j]);
+
+		hashtable_free(&listing->entries);
+		free(listing->names);
+		free(listing->dir);
+		free(listing);
+	}
+
+	for (size_t i = 0; i < resolver->dir_cnt; i++)
+		free(resolver->dirs[i]);
+
+	hashtable_free(&resolver->resolved);
+	hashtable_free(&resolver->listings);
+	free(resolver->dirs);
+	pthread_mutex_destroy(&resolver->lock);
+
+	*resolver = (include_resolver_t){0};
+}
+
+static int push_include(preprocessor_t *pp, const char *file_path, lexer_t *lexer);
+
+// Classic mode splices the file into the output right away, in fused mode
+// it becomes the next source on the lexer's stack
+static int process_include(preprocessor_t *pp, const char *line, size_t len, size_t depth, lexer_t *lexer)
+{
+	const char *name = 0;
+	size_t name_len = 0;
+
+	if (!parse_include(line, len, &name, &name_len)) 
+	{
+		print_error("Malformed #include statement");
+		return 1;
+	}
+
+	const char *include_file = resolve_include(&pp->resolver, name, name_len);
+	if (!include_file)
+	{
+		print_error("Could not find include file");
+		return 1;
+	}
+
+	if (lexer)
+		return push_include(pp, include_file, lexer);
+
+	return process_file(pp, include_file, depth + 1);
+}
+
+static int process_conditional(preprocessor_t *pp, directive_t directive, const char *args, size_t args_len)
+{
+	size_t name_len = 0;
+	const char *name = 0;
+
+	switch (directive)
+	{
+		case DIRECTIVE_ifdef:
+		case DIRECTIVE_ifndef:
+			name = read_macro_name(args, args_len, &name_len);
+			if (!name)
+			{
+				char *message = 0;
+				asprintf(&message, "Expected a macro name after #%s", DIRECTIVE_NAMES[directive]);
+				print_error(message);
+				free(message);
+				return 1;
+			}
+
+			push_conditional(pp, (macro_find(&pp->macros, name, name_len) != 0) == (directive == DIRECTIVE_ifdef));
+			return 0;
+		case DIRECTIVE_else:
+			if (!pp->cond_cnt || pp->conds[pp->cond_cnt - 1].seen_else)
+			{
+				print_error("#else without #ifdef");
+				return 1;
+			}
+
+			conditional_t *cond = &pp->conds[pp->cond_cnt - 1];
+			cond->seen_else = true;
+			cond->active = cond->parent_active && !cond->active;
+			return 0;
+		case DIRECTIVE_endif:
+			if (!pp->cond_cnt)
+			{
+				print_error("#endif without #ifdef");
+				return 1;
+			}
+
+			pp->cond_cnt--;
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+static int process_directive(preprocessor_t *pp, size_t file_idx, const char *line, size_t len, size_t depth, lexer_t *lexer)
+{
+	const char *args = 0;
+	size_t args_len = 0;
+	directive_t directive = parse_directive(line, len, &args, &args_len);
+
+	if (directive == DIRECTIVE_ifdef || directive == DIRECTIVE_ifndef || directive == DIRECTIVE_else || directive == DIRECTIVE_endif)
+		return process_conditional(pp, directive, args, args_len);
+
+	// everything else is skipped along with the lines around it
+	if (!is_active(pp))
 		return 0;
+
+	size_t name_len = 0;
+	const char *name = 0;
+
+	switch (directive)
+	{
+		case DIRECTIVE_include:
+			return process_include(pp, line, len, depth, lexer);
+		case DIRECTIVE_pragma:
+			// the whole word only, other pragmas are ignored
+			if (args_len >= 4 && strncmp(args, "once", 4) == 0 && (args_len == 4 || skip_blanks(args + 4, args + args_len) != args + 4))
+			{
+				pp->files[file_idx].once = true;
+				pp->once_events++;
+			}
+			return 0;
+		case DIRECTIVE_define:
+			return macro_define(&pp->macros, args, args_len);
+		case DIRECTIVE_undef:
+			name = read_macro_name(args, args_len, &name_len);
+			if (!name)
+			{
+				print_error("Expected a macro name after #undef");
+				return 1;
+			}
+
+			macro_undef(&pp->macros, name, name_len);
+			return 0;
+		default:
+			print_error("Unknown preprocessor directive");
+			return 1;
 	}
+}
 
-	bufncpy(writer, line);
-	return 0;
+// Offsets of the text have to fit in a token, end is one past the last
+// offset about to be handed out
+static int check_text_size(size_t end)
+{
+	if (end <= SRC_OFFSET_MAX)
+		return 0;
+
+	print_error("Preprocessed text exceeds 4 GiB\n");
+	return 1;
 }
 
-int process_file(const char *file_path, int depth, buf_writer_t *writer) 
+static int process_line(preprocessor_t *pp, size_t file_idx, const char *line, size_t len, size_t depth) 
 {
-	if (depth > MAX_INCLUDE_DEPTH) 
+	if (len && *line == '#')
+		return process_directive(pp, file_idx, line, len, depth, 0);
+
+	if (!is_active(pp))
+		return 0;
+
+	int status = 0;
+
+	if (check_text_size(pp->writer.cursor + len + 1))
+		return 1;
+
+	// files past SRC_OFFSET_MAX are refused on open, positions fit as well
+	if (pp->srcmap)
+		srcmap_add_run(pp->srcmap, (src_offset_t)pp->writer.cursor, pp->files[file_idx].map_file, (uint32_t)(line - pp->files[file_idx].source.data));
+
+	// without macros a line goes out untouched as a slice of the mapping
+	if (pp->macros.macros.count)
 	{
-		print_error("Include depth exceeds limits\n");
+		status = macro_expand(&pp->macros, line, len, &pp->writer);
+		if (!status)
+			status = check_text_size(pp->writer.cursor + 1);
+
+		// the expansion does not line up with the source, the newline does
+		if (!status && pp->srcmap)
+			srcmap_add_run(pp->srcmap, (src_offset_t)pp->writer.cursor, pp->files[file_idx].map_file, (uint32_t)(line + len - pp->files[file_idx].source.data));
+	}
+	else
+		bufslice(&pp->writer, line, len);
+
+	bufcpy(&pp->writer, "\n");
+	return status;
+}
+
+// Tracks whether a file has the shape of an include guard:
+// #ifndef X, #define X, ..., #endif with nothing but blank lines around
+void scan_guard(preprocessor_t *pp, guard_scan_t *guard, const char *line, size_t len, bool before)
+{
+	const char *args = 0;
+	size_t args_len = 0;
+
+	if (guard->state == GUARD_NONE)
+		return;
+
+	if (!before)
+	{
+		if (guard->state == GUARD_OPEN && pp->cond_cnt == guard->cond_depth)
+			guard->state = GUARD_CLOSED;
+		return;
+	}
+
+	directive_t directive = parse_directive(line, len, &args, &args_len);
+
+	if (guard->state == GUARD_START && directive == DIRECTIVE_ifndef)
+	{
+		guard->name = read_macro_name(args, args_len, &guard->name_len);
+		guard->cond_depth = pp->cond_cnt;
+		guard->state = guard->name ? GUARD_OPEN : GUARD_NONE;
+	}
+	else if (guard->state == GUARD_START || guard->state == GUARD_CLOSED)
+		guard->state = GUARD_NONE;
+	else if (directive == DIRECTIVE_else && pp->cond_cnt == guard->cond_depth + 1)
+		guard->state = GUARD_NONE;
+}
+
+static int process_source(preprocessor_t *pp, size_t file_idx, size_t depth)
+{
+	// lines are handed out as slices of the mapping, nothing is copied
+	// until the line lands in the output buffer
+	const char *cursor = pp->files[file_idx].source.data;
+	const char *end = cursor + pp->files[file_idx].source.size;
+	size_t cond_depth = pp->cond_cnt;
+	guard_scan_t guard = { .state = GUARD_START };
+	int status = 0;
+
+	while (cursor < end && !status) 
+	{
+		const char *newline = memchr(cursor, '\n', end - cursor);
+		const char *line_end = newline ? newline : end;
+		size_t len = strip_comments(cursor, line_end - cursor);
+
+		bool blank = is_blank(cursor, len);
+		if (!blank)
+			scan_guard(pp, &guard, cursor, len, true);
+
+		status = process_line(pp, file_idx, cursor, len, depth);
+
+		if (!blank)
+			scan_guard(pp, &guard, cursor, len, false);
+
+		cursor = line_end + 1;
+	}
+
+	if (!status && pp->cond_cnt != cond_depth)
+	{
+		print_error("Unterminated #ifdef at the end of file");
 		return 1;
 	}
 
-	FILE *file = fopen(file_path, "r");
-	if (!file) 
+	if (!status && guard.state == GUARD_CLOSED && !pp->files[file_idx].guard)
+		pp->files[file_idx].guard = strndup(guard.name, guard.name_len);
+
+	return status;
+}
+
+// The same header included from many places costs one hash lookup each time
+static included_file_t* find_file(preprocessor_t *pp, dev_t dev, ino_t ino)
+{
+	file_id_t id = { .dev = dev, .ino = ino };
+	uintptr_t idx = (uintptr_t)hashtable_get(&pp->file_ids, (const char*)&id, sizeof(id));
+
+	return idx ? &pp->files[idx - 1] : 0;
+}
+
+// Takes over an already prefetched mapping, or maps the file right here
+// and queues its includes for the prefetcher
+static included_file_t* add_file(preprocessor_t *pp, const char *file_path, const struct stat *st, const mapped_file_t *prefetched)
+{
+	mapped_file_t source = {0};
+
+	if (prefetched)
+		source = *prefetched;
+	else if (map_file(file_path, &source))
+		return 0;
+	else
+		prefetch_scan(&pp->prefetch, source.data, source.size);
+
+	if (pp->file_cnt + 1 >= pp->files_allocated)
+	{
+		pp->files_allocated *= 2;
+		pp->files = (included_file_t*)realloc(pp->files, pp->files_allocated * sizeof(included_file_t));
+	}
+
+	file_id_t* id = (file_id_t*)calloc(1, sizeof(file_id_t));
+	*id = (file_id_t){ .dev = st->st_dev, .ino = st->st_ino };
+
+	pp->files[pp->file_cnt] = (included_file_t){ .id = id, .mtime = st->st_mtim, .path = strdup(file_path), .source = source };
+	if (pp->srcmap)
+		pp->files[pp->file_cnt].map_file = srcmap_add_file(pp->srcmap, file_path);
+
+	hashtable_set(&pp->file_ids, (const char*)id, sizeof(*id), (void*)(uintptr_t)(pp->file_cnt + 1));
+
+	return &pp->files[pp->file_cnt++];
+}
+
+// Finds the file in the include table, loading it if it is new. Sets *skip
+// when include-once state or an include guard says it expands to nothing.
+static included_file_t* open_include(preprocessor_t *pp, const char *file_path, bool *skip)
+{
+	struct stat st = {0};
+	mapped_file_t source = {0};
+	included_file_t *file = 0;
+	int load_status = 0;
+
+	bool prefetched = prefetch_take(&pp->prefetch, file_path, &st, &source, &load_status);
+	if (!prefetched)
+		load_status = stat(file_path, &st);
+
+	if (!load_status)
+		file = find_file(pp, st.st_dev, st.st_ino);
+
+	// same file reached through another path, the table already has it mapped
+	if (file)
+		unmap_file(&source);
+
+	*skip = false;
+	if (file && (file->once || (file->guard && macro_find(&pp->macros, file->guard, strlen(file->guard)))))
+	{
+		pp->once_events++;
+		*skip = true;
+		return file;
+	}
+
+	// positions inside the file are 32 bit like the offsets
+	if (!file && !load_status && (size_t)st.st_size > SRC_OFFSET_MAX)
 	{
+		print_error("File exceeds 4 GiB\n");
+		unmap_file(&source);
+		return 0;
+	}
+
+	if (!file && !load_status)
+		file = add_file(pp, file_path, &st, prefetched ? &source : 0);
+
+	if (!file) 
 		print_error("Could not open file\n");
+
+	return file;
+}
+
+int process_file(preprocessor_t *pp, const char *file_path, size_t depth) 
+{
+	if (depth > MAX_INCLUDE_DEPTH) 
+	{
+		print_error("Include depth exceeds limits\n");
 		return 1;
 	}
 
-	char line[MAX_LINE_LENGTH];
-	while (fgets(line, MAX_LINE_LENGTH, file)) {
-		char *newline = strchr(line, '\n');
-		if (newline)	*newline = '\0';
-		if(process_line(line, depth, writer))
+	bool skip = false;
+	included_file_t *file = open_include(pp, file_path, &skip);
+
+	if (!file || skip)
+		return !file;
+
+	if (file->cached && file->cached_generation == pp->macros.generation)
+	{
+		if (check_text_size(pp->writer.cursor + file->content_end - file->content_start))
 			return 1;
+
+		// the copied range was checked when it was first written
+		if (pp->srcmap)
+			srcmap_repeat(pp->srcmap, (src_offset_t)file->content_start, (src_offset_t)file->content_end, (src_offset_t)pp->writer.cursor);
+		bufrepeat(&pp->writer, file->content_start, file->content_end - file->content_start);
+		return 0;
+	}
+
+	// the files table may move while we recurse, hold on to the index
+	size_t file_idx = file - pp->files;
+	size_t content_start = pp->writer.cursor;
+	size_t once_events = pp->once_events;
+	size_t generation = pp->macros.generation;
+	bool nested = file->in_progress;
+
+	file->in_progress = true;
+	int status = process_source(pp, file_idx, depth);
+
+	file = &pp->files[file_idx];
+	file->in_progress = nested;
+
+	// an expansion that neither touched include-once state nor the macro
+	// table is the same every time the macros look like they do now, so
+	// later includes just repeat it from the output
+	if (!status && !nested && once_events == pp->once_events && generation == pp->macros.generation)
+	{
+		file->cached = true;
+		file->content_start = content_start;
+		file->content_end = pp->writer.cursor;
+		file->cached_generation = generation;
+	}
+
+	return status;
+}
+
+// Fused mode: instead of building the expanded text, the lexer pulls from a
+// stack of sources. Every included file gets a frame here that mirrors its
+// source on the lexer's stack.
+
+static int push_include(preprocessor_t *pp, const char *file_path, lexer_t *lexer)
+{
+	if (pp->frame_cnt > MAX_INCLUDE_DEPTH) 
+	{
+		print_error("Include depth exceeds limits\n");
+		return 1;
+	}
+
+	bool skip = false;
+	included_file_t *file = open_include(pp, file_path, &skip);
+
+	if (!file || skip)
+		return !file;
+
+	// one past the end stays inside the range, that is where the lexer
+	// reports the end of the file
+	if (check_text_size((size_t)pp->next_offset + file->source.size + 1))
+		return 1;
+
+	if (pp->frame_cnt + 1 >= pp->frames_allocated)
+	{
+		pp->frames_allocated *= 2;
+		pp->frames = (include_frame_t*)realloc(pp->frames, pp->frames_allocated * sizeof(include_frame_t));
+	}
+
+	pp->frames[pp->frame_cnt++] = (include_frame_t){ .file_idx = file - pp->files, .cond_depth = pp->cond_cnt, .guard = { .state = GUARD_START } };
+
+	src_offset_t base = pp->next_offset;
+	pp->next_offset = (src_offset_t)(pp->next_offset + file->source.size + 1);
+	if (pp->srcmap)
+		srcmap_add_run(pp->srcmap, base, file->map_file, 0);
+
+	lexer_push_source(lexer, file->source.data, file->source.size, 0, true, base);
+
+	return 0;
+}
+
+int preprocess_fused_begin(preprocessor_t* pp, const char* file_path, lexer_t* lexer)
+{
+	return push_include(pp, file_path, lexer);
+}
+
+bool preprocess_active(const preprocessor_t* pp)
+{
+	return is_active(pp);
+}
+
+// Called with the directive line the lexer found at the start of a line
+int preprocess_directive(preprocessor_t* pp, lexer_t* lexer, const char* line, size_t len)
+{
+	len = strip_comments(line, len);
+	size_t frame_idx = pp->frame_cnt - 1;
+
+	scan_guard(pp, &pp->frames[frame_idx].guard, line, len, true);
+	int status = process_directive(pp, pp->frames[frame_idx].file_idx, line, len, pp->frame_cnt, lexer);
+
+	// the directive may have pushed a frame and moved the array
+	scan_guard(pp, &pp->frames[frame_idx].guard, line, len, false);
+
+	return status;
+}
+
+// Anything but a directive in a file rules out an include guard shape
+void preprocess_token_seen(preprocessor_t* pp)
+{
+	if (!pp->frame_cnt)
+		return;
+
+	guard_scan_t *guard = &pp->frames[pp->frame_cnt - 1].guard;
+	if (guard->state == GUARD_START || guard->state == GUARD_CLOSED)
+		guard->state = GUARD_NONE;
+}
+
+int preprocess_source_end(preprocessor_t* pp)
+{
+	include_frame_t *frame = &pp->frames[--pp->frame_cnt];
+
+	if (pp->cond_cnt != frame->cond_depth)
+	{
+		print_error("Unterminated #ifdef at the end of file");
+		return 1;
+	}
+
+	included_file_t *file = &pp->files[frame->file_idx];
+	if (frame->guard.state == GUARD_CLOSED && !file->guard)
+		file->guard = strndup(frame->guard.name, frame->guard.name_len);
+
+	return 0;
+}
+
+// Expands the rest of the line starting at a macro name, exactly like the
+// classic line based expansion would. *expanded is the text to lex in place
+// of the rest of the line, or NULL if the identifier is not a macro. It gets
+// a range of its own at *base that the source map points back at the line.
+int preprocess_macro(preprocessor_t* pp, const char* ident, size_t ident_len, const char* line_end, char** expanded, size_t* expanded_len, src_offset_t* base)
+{
+	*expanded = 0;
+	if (!pp->macros.macros.count || !macro_find(&pp->macros, ident, ident_len))
+		return 0;
+
+	buf_writer_t writer = { .buf = (char*)calloc(DEFAULT_MACRO_EXPANSION_ALLOC, sizeof(char)), .buf_len = DEFAULT_MACRO_EXPANSION_ALLOC };
+	size_t len = strip_comments(ident, line_end - ident);
+
+	if (macro_expand(&pp->macros, ident, len, &writer))
+	{
+		free(writer.buf);
+		return 1;
 	}
 
-	fclose(file);
+	*expanded = writer.buf;
+	*expanded_len = writer.cursor;
+
+	// the offset past the end of the expansion maps to the end of the line,
+	// which keeps lookups inside the expansion on the macro's line
+	if (check_text_size((size_t)pp->next_offset + writer.cursor + 2))
+	{
+		free(writer.buf);
+		*expanded = 0;
+		return 1;
+	}
+
+	*base = pp->next_offset;
+	pp->next_offset = (src_offset_t)(pp->next_offset + writer.cursor + 2);
+
+	if (pp->srcmap)
+	{
+		const included_file_t *file = &pp->files[pp->frames[pp->frame_cnt - 1].file_idx];
+		srcmap_add_run(pp->srcmap, *base, file->map_file, (uint32_t)(ident - file->source.data));
+		srcmap_add_run(pp->srcmap, (src_offset_t)(*base + writer.cursor + 1), file->map_file, (uint32_t)(ident + len - file->source.data));
+	}
 
 	return 0;
 }
 
-int preprocess(const char* file_path, char** buffer)
+void preprocessor_init(preprocessor_t* pp, size_t prefetch_threads)
+{
+	*pp = (preprocessor_t){
+		.writer = { .buf = (character_t*)calloc(DEFAULT_PREPROCESSOR_ALLOC, sizeof(character_t)), .buf_len = DEFAULT_PREPROCESSOR_ALLOC, .cursor = 0, .indent = 0 },
+		.files = (included_file_t*)calloc(DEFAULT_INCLUDED_FILES_ALLOC, sizeof(included_file_t)),
+		.files_allocated = DEFAULT_INCLUDED_FILES_ALLOC,
+		.conds = (conditional_t*)calloc(DEFAULT_CONDITIONALS_ALLOC, sizeof(conditional_t)),
+		.conds_allocated = DEFAULT_CONDITIONALS_ALLOC,
+		.frames = (include_frame_t*)calloc(DEFAULT_CONDITIONALS_ALLOC, sizeof(include_frame_t)),
+		.frames_allocated = DEFAULT_CONDITIONALS_ALLOC,
+	};
+
+	hashtable_init(&pp->file_ids, DEFAULT_HASHTABLE_CAPACITY);
+	macros_init(&pp->macros);
+	resolver_init(&pp->resolver);
+	prefetch_init(&pp->prefetch, prefetch_threads, &pp->resolver);
+}
+
+// Command line style definition: NAME or NAME=VALUE, a bare NAME is 1
+int preprocessor_define(preprocessor_t* pp, const char* definition)
+{
+	const char *value = strchr(definition, '=');
+	char *line = 0;
+
+	if (value)
+		asprintf(&line, "%.*s %s", (int)(value - definition), definition, value + 1);
+	else
+		asprintf(&line, "%s 1", definition);
+
+	int status = macro_define(&pp->macros, line, strlen(line));
+	free(line);
+
+	return status;
+}
+
+// Every file in the include table was opened by this compile, including
+// the ones later skipped by #pragma once or their include guard
+void preprocessor_deps(const preprocessor_t* pp, dep_list_t* deps)
 {
-	buf_writer_t writer = { .buf = (character_t*)calloc(DEFAULT_PREPROCESSOR_ALLOC, sizeof(character_t)), .buf_len = DEFAULT_PREPROCESSOR_ALLOC, .cursor = 0, .indent = 0 };
+	for (size_t i = 0; i < pp->file_cnt; i++)
+	{
+		char* path = realpath(pp->files[i].path, 0);
+		dep_list_add(deps, path ? path : pp->files[i].path);
+		free(path);
+	}
+}
 
-	if(process_file(file_path, 0, &writer))
+void preprocessor_free(preprocessor_t* pp)
+{
+	prefetch_free(&pp->prefetch);
+
+	for (size_t i = 0; i < pp->file_cnt; i++)
+	{
+		unmap_file(&pp->files[i].source);
+		free(pp->files[i].path);
+		free(pp->files[i].guard);
+		free(pp->files[i].id);
+	}
+
+	hashtable_free(&pp->file_ids);
+	macros_free(&pp->macros);
+	resolver_free(&pp->resolver);
+
+	free(pp->conds);
+	free(pp->frames);
+	free(pp->files);
+	free(pp->writer.buf);
+	*pp = (preprocessor_t){0};
+}
+
+// The expanded text is handed over to the caller, the files table stays
+// alive until preprocessor_free() so the include tree can be inspected
+int preprocess(preprocessor_t* pp, const char* file_path, char** buffer)
+{
+	if (process_file(pp, file_path, 0))
 		return 1;
 
-	bufend(&writer);
-	*buffer = writer.buf;
+	bufend(&pp->writer);
+	*buffer = pp->writer.buf;
+	pp->writer = (buf_writer_t){0};
 
 	return 0;
 }
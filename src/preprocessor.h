@@ -1,12 +1,181 @@
 #pragma once
 
 #include <stdlib.h>
-#include "lexer.h"
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
 
-#define MAX_LINE_LENGTH 1024
+#include "lexer.h"
+#include "buffer.h"
+#include "fs.h"
+#include "hashtable.h"
+#include "prefetch.h"
+#include "macro.h"
+#include "depfile.h"
+#include "srcmap.h"
 
 static const size_t MAX_INCLUDE_DEPTH = 50;
 static const size_t DEFAULT_PREPROCESSOR_ALLOC = 256;
-static const character_t* INCLUDE_STATEMENT = "#include";
+static const size_t DEFAULT_INCLUDED_FILES_ALLOC = 16;
+static const size_t DEFAULT_CONDITIONALS_ALLOC = 16;
+static const size_t DEFAULT_DIR_LISTING_ALLOC = 32;
+
+#define DIRECTIVES		\
+	DIRECTIVE(include)	\
+	DIRECTIVE(pragma)	\
+	DIRECTIVE(define)	\
+	DIRECTIVE(undef)	\
+	DIRECTIVE(ifdef)	\
+	DIRECTIVE(ifndef)	\
+	DIRECTIVE(else)		\
+	DIRECTIVE(endif)	\
+
+typedef enum DIRECTIVE_TYPE
+{
+	DIRECTIVE_UNKNOWN = 0,
+#define DIRECTIVE(NAME)	DIRECTIVE_##NAME,
+	DIRECTIVES
+#undef DIRECTIVE
+} directive_t;
+
+typedef enum GUARD_STATE
+{
+	GUARD_START,		// nothing but blank lines so far
+	GUARD_OPEN,		// inside the leading #ifndef
+	GUARD_CLOSED,		// its #endif was seen, only blank lines may follow
+	GUARD_NONE,
+} guard_state_t;
+
+typedef struct guard_scan
+{
+	guard_state_t state;
+	const char* name;
+	size_t name_len;
+	size_t cond_depth;
+} guard_scan_t;
+
+// Key of the file table, allocated on its own so it stays put while the
+// table grows
+typedef struct file_id
+{
+	dev_t dev;
+	ino_t ino;
+} file_id_t;
+
+typedef struct included_file
+{
+	file_id_t* id;
+	struct timespec mtime;
+	char* path;
+	mapped_file_t source;
+	uint32_t map_file;	// index in the source map's file table
+
+	bool once;		// #pragma once seen, later includes expand to nothing
+	char* guard;		// macro of a detected #ifndef/#define/#endif include guard
+	bool in_progress;	// currently being expanded somewhere up the include stack
+	bool cached;		// [content_start, content_end) of the output holds its expansion
+	size_t content_start;
+	size_t content_end;
+	size_t cached_generation;	// macro state the cached expansion was produced under
+} included_file_t;
+
+typedef struct resolved_include
+{
+	char* name;
+	char* path;		// NULL when no search directory has the file
+	char** probed;		// candidates tried before path, none of them existed
+	size_t probed_cnt;
+} resolved_include_t;
+
+typedef struct dir_listing
+{
+	char* dir;
+	hashtable_t entries;	// every name in the directory, values are unused
+	char** names;
+	size_t name_cnt;
+	size_t names_allocated;
+} dir_listing_t;
+
+// Maps include names to paths. Every directory is listed at most once and
+// both hits and misses are remembered, so a long search path costs hash
+// lookups instead of one failed open() per directory per include.
+typedef struct include_resolver
+{
+	char** dirs;
+	size_t dir_cnt;
+	size_t dirs_allocated;
+
+	hashtable_t resolved;	// include name -> resolved_include_t
+	hashtable_t listings;	// directory path -> dir_listing_t
+
+	pthread_mutex_t lock;	// prefetch workers resolve concurrently
+} include_resolver_t;
+
+typedef struct conditional
+{
+	bool active;		// lines under it are emitted
+	bool parent_active;
+	bool seen_else;
+} conditional_t;
+
+typedef struct include_frame
+{
+	size_t file_idx;
+	size_t cond_depth;
+	guard_scan_t guard;
+} include_frame_t;
+
+typedef struct preprocessor
+{
+	buf_writer_t writer;
+
+	included_file_t* files;
+	size_t file_cnt;
+	size_t files_allocated;
+	hashtable_t file_ids;	// file_id_t -> index in files + 1
+
+	size_t once_events;	// bumped whenever include-once state affects the output
+
+	macro_table_t macros;
+
+	conditional_t* conds;
+	size_t cond_cnt;
+	size_t conds_allocated;
+
+	// fused mode only: one frame per file on the lexer's source stack
+	include_frame_t* frames;
+	size_t frame_cnt;
+	size_t frames_allocated;
+
+	include_resolver_t resolver;
+	prefetcher_t prefetch;
+
+	// optional, records where every piece of the output came from. Fused
+	// mode hands each file a range of its own in a virtual offset space.
+	srcmap_t* srcmap;
+	src_offset_t next_offset;
+} preprocessor_t;
+
+directive_t parse_directive(const char* line, size_t len, const char** args, size_t* args_len);
+bool parse_include(const char* line, size_t len, const char** name, size_t* name_len);
+
+void resolver_init(include_resolver_t* resolver);
+void resolver_add_dir(include_resolver_t* resolver, const char* dir);
+const char* resolve_include(include_resolver_t* resolver, const char* name, size_t len);
+void resolver_free(include_resolver_t* resolver);
+
+void preprocessor_init(preprocessor_t* pp, size_t prefetch_threads);
+int preprocessor_define(preprocessor_t* pp, const char* definition);
+int preprocess(preprocessor_t* pp, const char* file_path, char** buffer);
+void preprocessor_deps(const preprocessor_t* pp, dep_list_t* deps);
+void preprocessor_free(preprocessor_t* pp);
+
+void scan_guard(preprocessor_t* pp, guard_scan_t* guard, const char* line, size_t len, bool before);
 
-int preprocess(const char* file_path, char** buffer);
+int preprocess_fused_begin(preprocessor_t* pp, const char* file_path, lexer_t* lexer);
+bool preprocess_active(const preprocessor_t* pp);
+int preprocess_directive(preprocessor_t* pp, lexer_t* lexer, const char* line, size_t len);
+void preprocess_token_seen(preprocessor_t* pp);
+int preprocess_source_end(preprocessor_t* pp);
+int preprocess_macro(preprocessor_t* pp, const char* ident, size_t ident_len, const char* line_end, char** expanded, size_t* expanded_len, src_offset_t* base);
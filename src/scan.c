@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+typedef size_t (*scan_fn)(const char* text, size_t len);
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static bool is_word(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c) || c == '_';
+}
+
+#define SCALAR_KERNEL(NAME, CLASS)				\
+static size_t NAME(const char* text, size_t len)		\
+{								\
+	size_t i = 0;						\
+	while (i < len && CLASS(text[i]))			\
+		i++;						\
+	return i;						\
+}
+
+SCALAR_KERNEL(whitespace_scalar, is_space)
+SCALAR_KERNEL(identifier_scalar, is_word)
+SCALAR_KERNEL(digits_scalar, is_digit)
+
+#ifdef SCAN_X86
+
+// Every kernel builds a mask of the bytes in its class, the run ends at the
+// first zero bit. Signed compares are fine: bytes >= 0x80 are negative and
+// fall outside every range. The tail shorter than a vector goes scalar so
+// no load crosses the end of the text.
+
+#define VECTOR_KERNEL(NAME, TARGET, VEC, WIDTH, LOAD, MOVEMASK, CLASS_MASK, SCALAR)	\
+__attribute__((target(TARGET)))							\
+static size_t NAME(const char* text, size_t len)					\
+{											\
+	size_t i = 0;									\
+	for (; i + WIDTH <= len; i += WIDTH)						\
+	{										\
+		VEC c = LOAD((const VEC*)(text + i));					\
+		uint32_t outside = ~(uint32_t)MOVEMASK(CLASS_MASK(c));			\
+		if (WIDTH < 32)								\
+			outside &= (1u << (WIDTH & 31)) - 1;				\
+		if (outside)								\
+			return i + __builtin_ctz(outside);				\
+	}										\
+	return i + SCALAR(text + i, len - i);						\
+}
+
+#define SSE_SET(C)		_mm_set1_epi8(C)
+#define SSE_IN(C, LO, HI)	_mm_and_si128(_mm_cmpgt_epi8(C, SSE_SET((LO) - 1)), _mm_cmplt_epi8(C, SSE_SET((HI) + 1)))
+
+__attribute__((target("sse2")))
+static inline __m128i space_mask_sse2(__m128i c)
+{
+	return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, SSE_SET(' ')), _mm_cmpeq_epi8(c, SSE_SET('\t'))),
+		_mm_or_si128(_mm_cmpeq_epi8(c, SSE_SET('\r')), _mm_cmpeq_epi8(c, SSE_SET('\n'))));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i digit_mask_sse2(__m128i c)
+{
+	return SSE_IN(c, '0', '9');
+}
+
+__attribute__((target("sse2")))
+static inline __m128i word_mask_sse2(__m128i c)
+{
+	__m128i lower = _mm_or_si128(c, SSE_SET(0x20));
+	return _mm_or_si128(_mm_or_si128(SSE_IN(lower, 'a', 'z'), SSE_IN(c, '0', '9')), _mm_cmpeq_epi8(c, SSE_SET('_')));
+}
+
+VECTOR_KERNEL(whitespace_sse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_movemask_epi8, space_mask_sse2, whitespace_scalar)
+VECTOR_KERNEL(identifier_sse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_movemask_epi8, word_mask_sse2, identifier_scalar)
+VECTOR_KERNEL(digits_sse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_movemask_epi8, digit_mask_sse2, digits_scalar)
+
+#define AVX_SET(C)		_mm256_set1_epi8(C)
+#define AVX_IN(C, LO, HI)	_mm256_and_si256(_mm256_cmpgt_epi8(C, AVX_SET((LO) - 1)), _mm256_cmpgt_epi8(AVX_SET((HI) + 1), C))
+
+__attribute__((target("avx2")))
+static inline __m256i space_mask_avx2(__m256i c)
+{
+	return _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, AVX_SET(' ')), _mm256_cmpeq_epi8(c, AVX_SET('\t'))),
+		_mm256_or_si256(_mm256_cmpeq_epi8(c, AVX_SET('\r')), _mm256_cmpeq_epi8(c, AVX_SET('\n'))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i digit_mask_avx2(__m256i c)
+{
+	return AVX_IN(c, '0', '9');
+}
+
+__attribute__((target("avx2")))
+static inline __m256i word_mask_avx2(__m256i c)
+{
+	__m256i lower = _mm256_or_si256(c, AVX_SET(0x20));
+	return _mm256_or_si256(_mm256_or_si256(AVX_IN(lower, 'a', 'z'), AVX_IN(c, '0', '9')), _mm256_cmpeq_epi8(c, AVX_SET('_')));
+}
+
+VECTOR_KERNEL(whitespace_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, _mm256_movemask_epi8, space_mask_avx2, whitespace_sse2)
+VECTOR_KERNEL(identifier_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, _mm256_movemask_epi8, word_mask_avx2, identifier_sse2)
+VECTOR_KERNEL(digits_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, _mm256_movemask_epi8, digit_mask_avx2, digits_sse2)
+
+#endif
+
+typedef struct code_range
+{
+	uint32_t first;
+	uint32_t last;
+} code_range_t;
+
+// C11 Annex D.1, minus the planes above the BMP which are checked by rule
+static const code_range_t IDENTIFIER_RANGES[] = {
+	{ 0x00A8, 0x00A8 }, { 0x00AA, 0x00AA }, { 0x00AD, 0x00AD }, { 0x00AF, 0x00AF },
+	{ 0x00B2, 0x00B5 }, { 0x00B7, 0x00BA }, { 0x00BC, 0x00BE }, { 0x00C0, 0x00D6 },
+	{ 0x00D8, 0x00F6 }, { 0x00F8, 0x00FF }, { 0x0100, 0x167F }, { 0x1681, 0x180D },
+	{ 0x180F, 0x1FFF }, { 0x200B, 0x200D }, { 0x202A, 0x202E }, { 0x203F, 0x2040 },
+	{ 0x2054, 0x2054 }, { 0x2060, 0x206F }, { 0x2070, 0x218F }, { 0x2460, 0x24FF },
+	{ 0x2776, 0x2793 }, { 0x2C00, 0x2DFF }, { 0x2E80, 0x2FFF }, { 0x3004, 0x3007 },
+	{ 0x3021, 0x302F }, { 0x3031, 0x303F }, { 0x3040, 0xD7FF }, { 0xF900, 0xFD3D },
+	{ 0xFD40, 0xFDCF }, { 0xFDF0, 0xFE44 }, { 0xFE47, 0xFFFD },
+};
+
+// Annex D.2: combining marks, allowed anywhere but at the start
+static const code_range_t NOT_INITIAL_RANGES[] = {
+	{ 0x0300, 0x036F }, { 0x1DC0, 0x1DFF }, { 0x20D0, 0x20FF }, { 0xFE20, 0xFE2F },
+};
+
+static bool in_ranges(uint32_t code, const code_range_t* ranges, size_t range_cnt)
+{
+	for (size_t i = 0; i < range_cnt; i++)
+	{
+		if (code >= ranges[i].first && code <= ranges[i].last)
+			return true;
+	}
+	return false;
+}
+
+// Length of the well formed UTF-8 sequence at text, 0 for stray
+// continuation bytes, truncated, overlong or surrogate encodings
+static size_t decode_utf8(const unsigned char* text, size_t len, uint32_t* code)
+{
+	size_t length = 0;
+	uint32_t min = 0;
+
+	if ((text[0] & 0xE0) == 0xC0)
+	{
+		length = 2, min = 0x80;
+		*code = text[0] & 0x1F;
+	}
+	else if ((text[0] & 0xF0) == 0xE0)
+	{
+		length = 3, min = 0x800;
+		*code = text[0] & 0x0F;
+	}
+	else if ((text[0] & 0xF8) == 0xF0)
+	{
+		length = 4, min = 0x10000;
+		*code = text[0] & 0x07;
+	}
+	else
+		return 0;
+
+	if (length > len)
+		return 0;
+
+	for (size_t i = 1; i < length; i++)
+	{
+		if ((text[i] & 0xC0) != 0x80)
+			return 0;
+		*code = (*code << 6) | (text[i] & 0x3F);
+	}
+
+	if (*code < min || *code > 0x10FFFF || (*code >= 0xD800 && *code <= 0xDFFF))
+		return 0;
+
+	return length;
+}
+
+static size_t utf8_identifier_char(const char* text, size_t len, bool initial)
+{
+	uint32_t code = 0;
+	size_t length = decode_utf8((const unsigned char*)text, len, &code);
+	if (!length)
+		return 0;
+
+	bool allowed = code >= 0x10000
+		? (code & 0xFFFF) <= 0xFFFD && code < 0xF0000
+		: in_ranges(code, IDENTIFIER_RANGES, sizeof(IDENTIFIER_RANGES) / sizeof(IDENTIFIER_RANGES[0]));
+
+	if (allowed && initial)
+		allowed = !in_ranges(code, NOT_INITIAL_RANGES, sizeof(NOT_INITIAL_RANGES) / sizeof(NOT_INITIAL_RANGES[0]));
+
+	return allowed ? length : 0;
+}
+
+static scan_fn whitespace_kernel = whitespace_scalar;
+static scan_fn identifier_kernel = identifier_scalar;
+static scan_fn digits_kernel = digits_scalar;
+static const char* kernel_name = "scalar";
+
+// Picked once before main, the lexer threads only ever read the pointers
+__attribute__((constructor))
+static void select_kernels()
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		whitespace_kernel = whitespace_avx2;
+		identifier_kernel = identifier_avx2;
+		digits_kernel = digits_avx2;
+		kernel_name = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		whitespace_kernel = whitespace_sse2;
+		identifier_kernel = identifier_sse2;
+		digits_kernel = digits_sse2;
+		kernel_name = "sse2";
+	}
+#endif
+}
+
+size_t scan_whitespace(const char* text, size_t len)
+{
+	return whitespace_kernel(text, len);
+}
+
+// The kernels only take ASCII, a block with a high bit set ends their run.
+// Only there is UTF-8 decoded, then the fast path picks up again.
+size_t scan_identifier(const char* text, size_t len)
+{
+	size_t i = identifier_kernel(text, len);
+
+	for (size_t n = 0; i < len && (text[i] & 0x80) && (n = utf8_identifier_char(text + i, len - i, false)); )
+	{
+		i += n;
+		i += identifier_kernel(text + i, len - i);
+	}
+
+	return i;
+}
+
+size_t scan_identifier_start(const char* text, size_t len)
+{
+	if (!len)
+		return 0;
+
+	if (text[0] & 0x80)
+		return utf8_identifier_char(text, len, true);
+
+	return is_word(text[0]) && !is_digit(text[0]);
+}
+
+size_t scan_digits(const char* text, size_t len)
+{
+	return digits_kernel(text, len);
+}
+
+// Eight digits in one word, the first in the lowest byte, folded into
+// two-, four- and then eight-digit values. No lane ever carries into the
+// next: 99, 9999 and 99999999 all fit their lanes.
+static uint64_t decimal8(const char* digits)
+{
+	uint64_t chunk = 0;
+	memcpy(&chunk, digits, sizeof(chunk));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	chunk = __builtin_bswap64(chunk);
+#endif
+
+	chunk -= 0x3030303030303030ull;
+	chunk = (chunk * 10 + (chunk >> 8)) & 0x00ff00ff00ff00ffull;
+	chunk = (chunk * 100 + (chunk >> 16)) & 0x0000ffff0000ffffull;
+	chunk = (chunk * 10000 + (chunk >> 32)) & 0x00000000ffffffffull;
+	return chunk;
+}
+
+bool scan_decimal_value(const char* digits, size_t len, uint64_t* value)
+{
+	uint64_t result = 0;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8)
+	{
+		uint64_t chunk = decimal8(digits + i);
+		if (result > (UINT64_MAX - chunk) / 100000000)
+			return false;
+		result = result * 100000000 + chunk;
+	}
+
+	for (; i < len; i++)
+	{
+		uint64_t digit = (uint64_t)(digits[i] - '0');
+		if (result > (UINT64_MAX - digit) / 10)
+			return false;
+		result = result * 10 + digit;
+	}
+
+	*value = result;
+	return true;
+}
+
+const char* scan_kernel_name()
+{
+	return kernel_name;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Character class kernels for the lexer. Each returns the length of the run
+// of its class at the start of text, never looking past len bytes. They go
+// 32 or 16 bytes per step where the CPU allows and fall back to scalar code.
+
+size_t scan_whitespace(const char* text, size_t len);	// ' ' '\t' '\r' '\n'
+size_t scan_identifier(const char* text, size_t len);	// [A-Za-z0-9_] and UTF-8 letters
+size_t scan_digits(const char* text, size_t len);	// [0-9]
+
+// Length of the character starting an identifier at text, 0 if it cannot.
+// Non-ASCII identifier characters are UTF-8 encoded code points from the
+// ranges C11 allows in identifiers (Annex D).
+size_t scan_identifier_start(const char* text, size_t len);
+
+// Exact value of a run of decimal digits, converted 8 at a time. False when
+// it does not fit 64 bits.
+bool scan_decimal_value(const char* digits, size_t len, uint64_t* value);
+
+const char* scan_kernel_name();
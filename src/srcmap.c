@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "srcmap.h"
+#include "buffer.h"
+#include "fs.h"
+#include "io.h"
+
+void srcmap_init(srcmap_t* map)
+{
+	*map = (srcmap_t){
+		.files = (srcmap_file_t*)calloc(DEFAULT_SRCMAP_FILES_ALLOC, sizeof(srcmap_file_t)),
+		.files_allocated = DEFAULT_SRCMAP_FILES_ALLOC,
+		.runs = (srcmap_run_t*)calloc(DEFAULT_SRCMAP_RUNS_ALLOC, sizeof(srcmap_run_t)),
+		.runs_allocated = DEFAULT_SRCMAP_RUNS_ALLOC,
+	};
+}
+
+uint32_t srcmap_add_file(srcmap_t* map, const char* path)
+{
+	if (map->file_cnt + 1 >= map->files_allocated)
+	{
+		map->files_allocated *= 2;
+		map->files = (srcmap_file_t*)realloc(map->files, map->files_allocated * sizeof(srcmap_file_t));
+	}
+
+	map->files[map->file_cnt] = (srcmap_file_t){ .path = strdup(path) };
+	return (uint32_t)map->file_cnt++;
+}
+
+// Runs have to come in increasing offset order. A run that just continues
+// the previous one is dropped, so a file copied line by line costs one run.
+void srcmap_add_run(srcmap_t* map, src_offset_t offset, uint32_t file, uint32_t pos)
+{
+	if (map->run_cnt)
+	{
+		srcmap_run_t* last = &map->runs[map->run_cnt - 1];
+
+		if (last->file == file && pos >= last->pos && offset - last->offset == pos - last->pos)
+			return;
+
+		// nothing was emitted under the previous run
+		if (last->offset == offset)
+		{
+			*last = (srcmap_run_t){ .offset = offset, .file = file, .pos = pos };
+			return;
+		}
+	}
+
+	if (map->run_cnt + 1 >= map->runs_allocated)
+	{
+		map->runs_allocated *= 2;
+		map->runs = (srcmap_run_t*)realloc(map->runs, map->runs_allocated * sizeof(srcmap_run_t));
+	}
+
+	map->runs[map->run_cnt++] = (srcmap_run_t){ .offset = offset, .file = file, .pos = pos };
+}
+
+// Index of the last run starting at or before offset, run_cnt if there is none
+static size_t find_run(const srcmap_t* map, src_offset_t offset)
+{
+	size_t low = 0, high = map->run_cnt;
+
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if (map->runs[mid].offset <= offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low ? low - 1 : map->run_cnt;
+}
+
+// [start, end) of the global text was copied to at, its runs are copied along
+void srcmap_repeat(srcmap_t* map, src_offset_t start, src_offset_t end, src_offset_t at)
+{
+	size_t first = find_run(map, start);
+	size_t last = map->run_cnt;
+
+	if (first == map->run_cnt || start >= end)
+		return;
+
+	srcmap_run_t run = map->runs[first];
+	srcmap_add_run(map, at, run.file, run.pos + (start - run.offset));
+
+	for (size_t i = first + 1; i < last && map->runs[i].offset < end; i++)
+	{
+		run = map->runs[i];
+		srcmap_add_run(map, at + (run.offset - start), run.file, run.pos);
+	}
+}
+
+static bool load_file(srcmap_file_t* file)
+{
+	if (file->loaded)
+		return file->line_starts != 0;
+
+	file->loaded = true;
+	if (map_file(file->path, &file->source))
+		return false;
+
+	// the preprocessor refuses such files, positions are 32 bit
+	if (file->source.size > SRC_OFFSET_MAX)
+		return false;
+
+	size_t allocated = DEFAULT_LINE_STARTS_ALLOC;
+	file->line_starts = (uint32_t*)calloc(allocated, sizeof(uint32_t));
+	file->line_cnt = 1;
+
+	const char* cursor = file->source.data;
+	const char* end = cursor + file->source.size;
+	while (cursor < end && (cursor = memchr(cursor, '\n', end - cursor)))
+	{
+		if (file->line_cnt + 1 >= allocated)
+		{
+			allocated *= 2;
+			file->line_starts = (uint32_t*)realloc(file->line_starts, allocated * sizeof(uint32_t));
+		}
+
+		file->line_starts[file->line_cnt++] = (uint32_t)(++cursor - file->source.data);
+	}
+
+	return true;
+}
+
+// Nothing is resolved up front: the run is found by binary search, the
+// file's line table is built the first time a location inside it is needed
+bool srcmap_lookup(srcmap_t* map, src_offset_t offset, source_location_t* location)
+{
+	size_t run_idx = find_run(map, offset);
+	if (run_idx == map->run_cnt)
+		return false;
+
+	const srcmap_run_t* run = &map->runs[run_idx];
+	srcmap_file_t* file = &map->files[run->file];
+	if (!load_file(file) || !file->source.data)
+		return false;
+
+	size_t pos = run->pos + (offset - run->offset);
+
+	// an expanded macro is longer than its source, it never runs into the
+	// part of the file the next run continues with
+	const srcmap_run_t* next = run_idx + 1 < map->run_cnt ? run + 1 : 0;
+	if (next && next->file == run->file && next->pos > run->pos && pos > next->pos)
+		pos = next->pos;
+
+	if (pos > file->source.size)
+		pos = file->source.size;
+
+	size_t low = 0, high = file->line_cnt;
+	while (low + 1 < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if (file->line_starts[mid] <= pos)
+			low = mid;
+		else
+			high = mid;
+	}
+
+	const char* line = file->source.data + file->line_starts[low];
+	const char* end = file->source.data + file->source.size;
+	const char* newline = line < end ? memchr(line, '\n', end - line) : 0;
+
+	*location = (source_location_t){
+		.path = file->path,
+		.line = low + 1,
+		.column = pos - file->line_starts[low] + 1,
+		.line_text = line,
+		.line_len = (newline ? newline : end) - line,
+	};
+
+	// expanded macros make a line longer than its source
+	if (location->column > location->line_len + 1)
+		location->column = location->line_len + 1;
+
+	return true;
+}
+
+void srcmap_print(srcmap_t* map, src_offset_t offset)
+{
+	source_location_t location = {0};
+	if (!srcmap_lookup(map, offset, &location))
+		return;
+
+	fprintf(stderr, "%s:%zu:%zu\n", location.path, location.line, location.column);
+	print_line(location.line_text, location.line_len, location.line);
+}
+
+void srcmap_serialize(const srcmap_t* map, buf_writer_t* writer)
+{
+	char* line = 0;
+
+	bufncpy(writer, SRCMAP_MAGIC);
+
+	for (size_t i = 0; i < map->file_cnt; i++)
+	{
+		bufcpy(writer, "file ");
+		bufncpy(writer, map->files[i].path);
+	}
+
+	for (size_t i = 0; i < map->run_cnt; i++)
+	{
+		asprintf(&line, "run %u %u %u", map->runs[i].offset, map->runs[i].file, map->runs[i].pos);
+		bufncpy(writer, line);
+		free(line);
+	}
+}
+
+// The inverse of srcmap_serialize(), text is modified in place
+int srcmap_parse(srcmap_t* map, char* text)
+{
+	char* saveptr = 0;
+	char* line = strtok_r(text, "\n", &saveptr);
+	if (!line || strcmp(line, SRCMAP_MAGIC) != 0)
+		return 1;
+
+	while ((line = strtok_r(0, "\n", &saveptr)))
+	{
+		srcmap_run_t run = {0};
+
+		if (!strncmp(line, "file ", strlen("file ")))
+			srcmap_add_file(map, line + strlen("file "));
+		else if (sscanf(line, "run %u %u %u", &run.offset, &run.file, &run.pos) == 3 && run.file < map->file_cnt)
+			srcmap_add_run(map, run.offset, run.file, run.pos);
+		else
+			return 1;
+	}
+
+	return 0;
+}
+
+void srcmap_free(srcmap_t* map)
+{
+	for (size_t i = 0; i < map->file_cnt; i++)
+	{
+		unmap_file(&map->files[i].source);
+		free(map->files[i].line_starts);
+		free(map->files[i].path);
+	}
+
+	free(map->files);
+	free(map->runs);
+	*map = (srcmap_t){0};
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fs.h"
+#include "buffer.h"
+
+static const char* SRCMAP_MAGIC = "ykkmap 1";
+static const size_t DEFAULT_SRCMAP_FILES_ALLOC = 16;
+static const size_t DEFAULT_SRCMAP_RUNS_ALLOC = 64;
+static const size_t DEFAULT_LINE_STARTS_ALLOC = 256;
+
+// Global offsets are 32 bit, that is what tokens carry. Text that would
+// reach past SRC_OFFSET_MAX is rejected where the offsets are handed out.
+typedef uint32_t src_offset_t;
+static const size_t SRC_OFFSET_MAX = UINT32_MAX;
+
+typedef struct srcmap_file
+{
+	char* path;
+
+	// only filled in once a location inside the file is asked for
+	mapped_file_t source;
+	uint32_t* line_starts;
+	size_t line_cnt;
+	bool loaded;
+} srcmap_file_t;
+
+// From offset on the global text is a verbatim copy of the file starting at
+// pos, up to the next run
+typedef struct srcmap_run
+{
+	src_offset_t offset;
+	uint32_t file;
+	uint32_t pos;
+} srcmap_run_t;
+
+typedef struct srcmap
+{
+	srcmap_file_t* files;
+	size_t file_cnt;
+	size_t files_allocated;
+
+	srcmap_run_t* runs;		// sorted by offset
+	size_t run_cnt;
+	size_t runs_allocated;
+} srcmap_t;
+
+typedef struct source_location
+{
+	const char* path;
+	size_t line;		// 1 based
+	size_t column;		// 1 based
+	const char* line_text;
+	size_t line_len;
+} source_location_t;
+
+void srcmap_init(srcmap_t* map);
+uint32_t srcmap_add_file(srcmap_t* map, const char* path);
+void srcmap_add_run(srcmap_t* map, src_offset_t offset, uint32_t file, uint32_t pos);
+void srcmap_repeat(srcmap_t* map, src_offset_t start, src_offset_t end, src_offset_t at);
+bool srcmap_lookup(srcmap_t* map, src_offset_t offset, source_location_t* location);
+void srcmap_print(srcmap_t* map, src_offset_t offset);
+void srcmap_serialize(const srcmap_t* map, buf_writer_t* writer);
+int srcmap_parse(srcmap_t* map, char* text);
+void srcmap_free(srcmap_t* map);
@@ -5,15 +5,41 @@
 #include "parser.h"
 #include "translator.h"
 #include "buffer.h"
+#include "module.h"
+#include "intern.h"
+#include "log.h"
+#include "walk.h"
 
 
-char* generate_label(char* prefix)
+// set while compiling a module, keeps its labels apart from its importers'
+static const char* label_prefix = "";
+
+char* generate_label(const char* prefix)
 {
 	static size_t identifier_cnt = 0;
 
 	char* label = 0;
-	asprintf(&label, "%ld_%s", identifier_cnt++, prefix);
-	return label;
+	asprintf(&label, "%s%ld_%s", label_prefix, identifier_cnt++, prefix);
+
+	// the assembler only takes ASCII labels, UTF-8 names are spelled in hex
+	size_t len = strlen(label), escaped = 0;
+	for (size_t i = 0; i < len; i++)
+		escaped += (label[i] & 0x80) != 0;
+
+	if (!escaped)
+		return label;
+
+	char* ascii = (char*)calloc(len + escaped * 2 + 1, sizeof(char));
+	for (size_t i = 0, j = 0; i < len; i++)
+	{
+		if (label[i] & 0x80)
+			j += sprintf(ascii + j, "%02x", (unsigned char)label[i]);
+		else
+			ascii[j++] = label[i];
+	}
+
+	free(label);
+	return ascii;
 }
 
 typedef enum SCOPE
@@ -35,6 +61,7 @@ typedef struct function
 {
 	char* label;
 	size_t arg_cnt;
+	bool imported;
 } function_t;
 
 typedef struct variable 
@@ -46,7 +73,7 @@ typedef struct variable
 typedef struct identifier
 {
 	identifier_type_t type;
-	character_t* identifier;
+	symbol_t name;
 
 	union {
 		function_t function;
@@ -74,6 +101,9 @@ void init_identifiers()
 void free_identifiers()
 {
 	free(identifiers);
+	identifiers = 0;
+	identifier_cnt = 0;
+	identifiers_allocated = 0;
 }
 
 void ensure_allocated()
@@ -86,31 +116,42 @@ void ensure_allocated()
 	}
 }
 
-identifier_t* add_var(character_t* name, scope_t scope)
+static symbol_t entrypoint_symbol()
+{
+	return intern(ENTRYPOINT_NAME, strlen(ENTRYPOINT_NAME));
+}
+
+identifier_t* add_var(symbol_t name, scope_t scope)
 {	
 	ensure_allocated();
-	char* label = generate_label(name);
-	identifiers[identifier_cnt++] = (identifier_t){.type = TYPE_VARIABLE, .identifier = strdup(name), .value.variable.scope = scope, .value.variable.label = label};
+	char* label = generate_label(symbol_name(name));
+	identifiers[identifier_cnt++] = (identifier_t){.type = TYPE_VARIABLE, .name = name, .value.variable.scope = scope, .value.variable.label = label};
 
 	return &identifiers[identifier_cnt - 1];
 }
 
-char* add_function(character_t* name, size_t arg_cnt)
+char* add_function(symbol_t name, size_t arg_cnt)
 {	
 	ensure_allocated();
-	char* label = (strcmp(name, ENTRYPOINT_NAME) == 0) ? strdup(name) : generate_label(name);
+	char* label = (name == entrypoint_symbol() && !*label_prefix) ? strdup(ENTRYPOINT_NAME) : generate_label(symbol_name(name));
 
-	identifiers[identifier_cnt++] = (identifier_t){.type = TYPE_FUNCTION, .identifier = strdup(name), .value.function.label = label, .value.function.arg_cnt = arg_cnt};
+	identifiers[identifier_cnt++] = (identifier_t){.type = TYPE_FUNCTION, .name = name, .value.function.label = label, .value.function.arg_cnt = arg_cnt};
 
-	fprintf(stderr, "adding function named %s with %ld arguments with label %s\n", name, arg_cnt, label);
+	LOG_DEBUG(translator, "adding function named %s with %ld arguments with label %s", symbol_name(name), arg_cnt, label);
 	return label;
 }
 
-identifier_t* get_function(character_t* name)
+void import_function(const module_export_t* export)
+{
+	ensure_allocated();
+	identifiers[identifier_cnt++] = (identifier_t){.type = TYPE_FUNCTION, .name = intern(export->name, strlen(export->name)), .value.function.label = strdup(export->label), .value.function.arg_cnt = export->arg_cnt, .value.function.imported = true};
+}
+
+identifier_t* get_function(symbol_t name)
 {
 	for(int i = 0; i < identifier_cnt; i++)
 	{
-		if(identifiers[i].type != TYPE_FUNCTION || strcmp(identifiers[i].identifier, name))
+		if(identifiers[i].type != TYPE_FUNCTION || identifiers[i].name != name)
 			continue;
 
 		return &identifiers[i];
@@ -119,11 +160,11 @@ identifier_t* get_function(character_t* name)
 	return 0;
 }
 
-identifier_t* get_variable(character_t* name)
+identifier_t* get_variable(symbol_t name)
 {
 	for(int i = 0; i < identifier_cnt; i++)
 	{
-		if(identifiers[i].type != TYPE_VARIABLE || strcmp(identifiers[i].identifier, name))
+		if(identifiers[i].type != TYPE_VARIABLE || identifiers[i].name != name)
 			continue;
 
 		return &identifiers[i];
@@ -132,16 +173,10 @@ identifier_t* get_variable(character_t* name)
 	return 0;
 }
 
-int push_var(buf_writer_t* writer, character_t* identifier)
+int push_var(buf_writer_t* writer, symbol_t identifier)
 {
-	if(!identifier)
-	{
-		printf("invalid identifier!\n");
-		exit(1);
-		return 0;
-	}
 	bufcpy(writer, ";(ident)  ");
-	bufncpy(writer, identifier);
+	bufncpy(writer, symbol_name(identifier));
 	identifier_t* var = get_variable(identifier);
 
 	if(!var)	
@@ -154,10 +189,10 @@ int push_var(buf_writer_t* writer, character_t* identifier)
 	return 1;
 }
 
-void pop_var(buf_writer_t* writer, character_t* identifier)
+void pop_var(buf_writer_t* writer, symbol_t identifier)
 {
 	bufcpy(writer, ";(ident)  ");
-	bufncpy(writer, identifier);
+	bufncpy(writer, symbol_name(identifier));
 	identifier_t* var = get_variable(identifier);
 
 	if(!var)	
@@ -170,238 +205,290 @@ void pop_var(buf_writer_t* writer, character_t* identifier)
 	bufncpy(writer, "], ax");
 }
 
-void translate_recursive(buf_writer_t* writer, ASTNode* node)
+static void translate_operator(buf_writer_t* writer, token_type_t op)
 {
-	if(!node) return;
-	char* fmtbuf = 0;
-
-	switch(node->type)
+	switch(op)
 	{
-		case AST_IDENTIFIER:
-			push_var(writer, node->data.identifier);
+		case TOKEN_PLUS:
+			bufncpy(writer, "add");
 			break;
-		case AST_NUMBER:
-			asprintf(&fmtbuf, "push %ld", node->data.number);
-			bufncpy(writer, fmtbuf);
+		case TOKEN_MINUS:
+			bufncpy(writer, "sub");
 			break;
-		case AST_BLOCK:
-			for(int i = 0; i < node->data.block.child_count; i++)
-				translate_recursive(writer, node->data.block.children[i]);
+		case TOKEN_STAR:
+			bufncpy(writer, "mul");
 			break;
-		case AST_PROGRAM:
-			bufncpy(writer, "; program begin");
-			for(int i = 0; i < node->data.program.child_count; i++)
-				translate_recursive(writer, node->data.program.children[i]);
-			bufncpy(writer, "; program end");
+		case TOKEN_SLASH:
+			bufncpy(writer, "div");
 			break;
-		case AST_DECLARATION:
-			// assume global
-			char* var_label = add_var(node->data.declaration.identifier->data.identifier, GLOBAL)->value.variable.label;
-			printf("declared var with name %s\n", node->data.declaration.identifier->data.identifier);
-			translate_recursive(writer, node->data.declaration.initializer);
-			bufncpy(writer, "pop ax");
-			bufcpy(writer, "mov [");
-			bufcpy(writer, var_label);
-			bufncpy(writer, "], ax");
+		case TOKEN_CARET:
+			bufncpy(writer, "xor");
 			break;
-		case AST_FUNCTION:
-			bufncpy(writer, "\n");
-			char* func_label = add_function(node->data.function.name->data.identifier, node->data.function.param_count);
-			bufcpy(writer, func_label);
-			bufncpy(writer, ":");
-
-			bufncpy(writer, "; args");
-			for(int i = 0; i < node->data.function.param_count; i++)
-			{
-				translate_recursive(writer, node->data.function.parameters[i]);
-			}
-
-			translate_recursive(writer, node->data.function.body);
-			bufncpy(writer, "\n");
+		case TOKEN_BAR:
+			bufncpy(writer, "or");
 			break;
-		case AST_ASSIGNMENT:
-			translate_recursive(writer, node->data.assignment.right);
-			pop_var(writer, node->data.assignment.left->data.identifier);
-			// bufncpy(writer, "; var");
+		case TOKEN_AMPERSAND:
+			bufncpy(writer, "and");
 			break;
-		case AST_BINARY:
-			if(!node->data.binary_op.op)
-				break;
-
-			translate_recursive(writer, node->data.binary_op.left);
-			translate_recursive(writer, node->data.binary_op.right);
-
-			switch(node->data.binary_op.op)
-			{
-				case TOKEN_PLUS:
-					bufncpy(writer, "add");
-					break;
-				case TOKEN_MINUS:
-					bufncpy(writer, "sub");
-					break;
-				case TOKEN_STAR:
-					bufncpy(writer, "mul");
-					break;
-				case TOKEN_SLASH:
-					bufncpy(writer, "div");
-					break;
-				case TOKEN_CARET:
-					bufncpy(writer, "xor");
-					break;
-				case TOKEN_BAR:
-					bufncpy(writer, "or");
-					break;
-				case TOKEN_AMPERSAND:
-					bufncpy(writer, "and");
-					break;
-				case TOKEN_EQUALS:
-					bufncpy(writer, "cmp");
-					bufncpy(writer, "push FLAGS");
-					bufncpy(writer, "push 1");
-					bufncpy(writer, "and");
-					bufncpy(writer, "push 0");
-					bufncpy(writer, "cmp");
-					break;
-				case TOKEN_LESS:
-					bufncpy(writer, "cmp");
-					bufncpy(writer, "push FLAGS");
-					bufncpy(writer, "push 2");
-					bufncpy(writer, "and");
-					bufncpy(writer, "push 0");
-					bufncpy(writer, "cmp");
-					break;
-				case TOKEN_GREATER:
-					bufncpy(writer, "cmp");
-					bufncpy(writer, "push FLAGS");
-					bufncpy(writer, "push 2");
-					bufncpy(writer, "and");
-					bufncpy(writer, "push 2");
-					bufncpy(writer, "xor");
-					bufncpy(writer, "push 0");
-					bufncpy(writer, "cmp");
-					break;
-				default:
-					break;
-			}
+		case TOKEN_EQUALS:
+			bufncpy(writer, "cmp");
+			bufncpy(writer, "push FLAGS");
+			bufncpy(writer, "push 1");
+			bufncpy(writer, "and");
+			bufncpy(writer, "push 0");
+			bufncpy(writer, "cmp");
 			break;
-		case AST_IF:
-			char* if_label = generate_label("if");
-			char* else_label = generate_label("else");
-
-			bufncpy(writer, "; begin if");
-
-			translate_recursive(writer, node->data.if_statement.condition);
-			bufcpy(writer, "jle ");
-			bufncpy(writer, else_label);
-
-			translate_recursive(writer, node->data.if_statement.then_branch);
-			if(node->data.if_statement.else_branch)
-			{
-				bufcpy(writer, "jmp ");
-				bufncpy(writer, if_label);
-			}
-
-			bufcpy(writer, else_label);
-			bufncpy(writer, ":");
-
-			if(node->data.if_statement.else_branch)
-			{
-				bufncpy(writer, "; else");
-				translate_recursive(writer, node->data.if_statement.else_branch);
-				bufcpy(writer, if_label);
-				bufncpy(writer, ":");
-			}
-
+		case TOKEN_LESS:
+			bufncpy(writer, "cmp");
+			bufncpy(writer, "push FLAGS");
+			bufncpy(writer, "push 2");
+			bufncpy(writer, "and");
+			bufncpy(writer, "push 0");
+			bufncpy(writer, "cmp");
 			break;
+		case TOKEN_GREATER:
+			bufncpy(writer, "cmp");
+			bufncpy(writer, "push FLAGS");
+			bufncpy(writer, "push 2");
+			bufncpy(writer, "and");
+			bufncpy(writer, "push 2");
+			bufncpy(writer, "xor");
+			bufncpy(writer, "push 0");
+			bufncpy(writer, "cmp");
+			break;
+		default:
+			break;
+	}
+}
 
-		case AST_WHILE:
-			char* end_while = generate_label("whileend");
-			char* start_while = generate_label("whilestart");
-
-			bufcpy(writer, start_while);
-			bufncpy(writer, ":");
+static identifier_t* check_call(const ast_t* ast, const ast_node_t* node)
+{
+	identifier_t* called = get_function(node->data.function_call.name);
+	size_t arg_cnt = ast_list_cnt(ast, node->data.function_call.arguments);
 
-			translate_recursive(writer, node->data.while_statement.condition);
-			bufcpy(writer, "jle ");
-			bufncpy(writer, end_while);
+	if(!called)
+	{
+		fprintf(stderr, "Unknown function identifier %s!\n", symbol_name(node->data.function_call.name));
+		exit(1);
+	}
 
-			bufncpy(writer, "; body");
-			translate_recursive(writer, node->data.while_statement.body);
-			bufcpy(writer, "jmp ");
-			bufncpy(writer, start_while);
+	if(arg_cnt != called->value.function.arg_cnt)
+	{
+		fprintf(stderr, "Argument count mismatch in %s, expected %ld got %ld\n", symbol_name(node->data.function_call.name), called->value.function.arg_cnt, arg_cnt);
+		exit(1);
+	}
 
-			bufcpy(writer, end_while);
-			bufncpy(writer, ":");
+	return called;
+}
 
-			break;
-		case AST_INLINE_ASM:
-			bufncpy(writer, node->data.identifier);
-			break;
-		case AST_FUNCTION_CALL:
-			identifier_t* called = get_function(node->data.function_call.name->data.identifier);
+// Emits each node's code at the steps of the walk it belongs to: what goes
+// before, between and after the code of its children
+static void translate_ast(buf_writer_t* writer, const ast_t* ast)
+{
+	ast_walk_t walk;
+	ast_walk_init(&walk, ast, ast->root);
 
-			if(!called)
-			{
-				fprintf(stderr, "Unknown function identifier %s!\n", node->data.function_call.name->data.identifier);
-				exit(1);
-			}
+	while(ast_walk_next(&walk))
+	{
+		ast_walk_frame_t* frame = ast_walk_top(&walk);
+		const ast_node_t* node = frame->node;
+		size_t step = frame->step;
+		bool last = step == frame->child_cnt;
+		char* fmtbuf = 0;
+
+		switch(node->type)
+		{
+			case AST_IDENTIFIER:
+				push_var(writer, node->data.symbol);
+				break;
+			case AST_NUMBER:
+				asprintf(&fmtbuf, "push %ld", ast_number(ast, node));
+				bufncpy(writer, fmtbuf);
+				free(fmtbuf);
+				break;
+			case AST_BLOCK:
+				break;
+			case AST_PROGRAM:
+				if(!step)
+					bufncpy(writer, "; program begin");
+				if(last)
+					bufncpy(writer, "; program end");
+				break;
+			case AST_DECLARATION:
+				if(!step)
+				{
+					// assume global
+					frame->locals[0] = add_var(node->data.declaration.name, GLOBAL)->value.variable.label;
+					LOG_DEBUG(translator, "declared var with name %s", symbol_name(node->data.declaration.name));
+				}
+				else if(last)
+				{
+					bufncpy(writer, "pop ax");
+					bufcpy(writer, "mov [");
+					bufcpy(writer, (char*)frame->locals[0]);
+					bufncpy(writer, "], ax");
+				}
+				break;
+			case AST_FUNCTION:
+				if(!step)
+				{
+					bufncpy(writer, "\n");
+					char* func_label = add_function(node->data.function.name, ast_list_cnt(ast, node->data.function.parameters));
+					bufcpy(writer, func_label);
+					bufncpy(writer, ":");
+
+					bufncpy(writer, "; args");
+				}
+				else if(last)
+					bufncpy(writer, "\n");
+				break;
+			case AST_ASSIGNMENT:
+				if(last)
+					pop_var(writer, node->data.assignment.name);
+				break;
+			case AST_BINARY:
+				if(!node->op)
+				{
+					if(!last)
+						ast_walk_skip(&walk);
+					break;
+				}
 
-			if(node->data.function_call.arg_count != called->value.function.arg_cnt)
-			{
-				fprintf(stderr, "Argument count mismatch in %s, expected %ld got %ld\n", node->data.function_call.name->data.identifier, called->value.function.arg_cnt, node->data.function_call.arg_count);
+				if(last)
+					translate_operator(writer, (token_type_t)node->op);
+				break;
+			case AST_IF:
+				switch(step)
+				{
+					case 0:
+						frame->locals[0] = generate_label("if");
+						frame->locals[1] = generate_label("else");
+						bufncpy(writer, "; begin if");
+						break;
+					case 1:
+						bufcpy(writer, "jle ");
+						bufncpy(writer, (char*)frame->locals[1]);
+						break;
+					case 2:
+						if(node->data.if_statement.else_branch)
+						{
+							bufcpy(writer, "jmp ");
+							bufncpy(writer, (char*)frame->locals[0]);
+						}
+
+						bufcpy(writer, (char*)frame->locals[1]);
+						bufncpy(writer, ":");
+
+						if(node->data.if_statement.else_branch)
+							bufncpy(writer, "; else");
+						break;
+					default:
+						if(node->data.if_statement.else_branch)
+						{
+							bufcpy(writer, (char*)frame->locals[0]);
+							bufncpy(writer, ":");
+						}
+						break;
+				}
+				break;
+			case AST_WHILE:
+				switch(step)
+				{
+					case 0:
+						frame->locals[0] = generate_label("whileend");
+						frame->locals[1] = generate_label("whilestart");
+
+						bufcpy(writer, (char*)frame->locals[1]);
+						bufncpy(writer, ":");
+						break;
+					case 1:
+						bufcpy(writer, "jle ");
+						bufncpy(writer, (char*)frame->locals[0]);
+						bufncpy(writer, "; body");
+						break;
+					default:
+						bufcpy(writer, "jmp ");
+						bufncpy(writer, (char*)frame->locals[1]);
+
+						bufcpy(writer, (char*)frame->locals[0]);
+						bufncpy(writer, ":");
+						break;
+				}
+				break;
+			case AST_INLINE_ASM:
+				bufncpy(writer, ast_asm_text(ast, node));
+				break;
+			case AST_FUNCTION_CALL:
+				if(!step)
+					frame->locals[0] = check_call(ast, node);
+				if(last)
+				{
+					bufcpy(writer, "call ");
+					bufncpy(writer, ((identifier_t*)frame->locals[0])->value.function.label);
+					bufncpy(writer, "push dx");
+				}
+				break;
+			case AST_RETURN:
+				if(last)
+				{
+					bufncpy(writer, "pop dx");
+					bufncpy(writer, "ret");
+				}
+				break;
+			case AST_IMPORT:
+				// resolved by the driver, the exports are already registered
+				break;
+			default:
+				fprintf(stderr, "unknown node! (%d)\n", node->type);
 				exit(1);
-			}
-
-			for(int i = 0; i < node->data.function_call.arg_count; i++)
-			{
-				translate_recursive(writer, node->data.function_call.arguments[i]);
-				// if(!push_var(writer, node->data.function_call.arguments[i]->data.identifier))
-				// if(node->data.function_call.arguments[i]->type == TYPE_VARIABLE && push_var(writer, node->data.function_call.arguments[i]->data.identifier))
-				// {
-				// 	fprintf(stderr, "Unknown argument in function %s: %s\n", node->data.function_call.name->data.identifier, node->data.function_call.arguments[i]->data.identifier);
-				// 	exit(1);
-				// }
-				// else 
-				// {
-				// 	bufcpy(writer, "push ");
-				// }
-
-			}
-
-			bufcpy(writer, "call ");
-			bufncpy(writer, called->value.function.label);
-			bufncpy(writer, "push dx");
-			break;
-		case AST_RETURN:
-			translate_recursive(writer, node->data.return_statement.value);
-			bufncpy(writer, "pop dx");
-			bufncpy(writer, "ret");
-			break;
-		default:
-			fprintf(stderr, "unknown node! (%d)\n", node->type);
-			exit(1);
-			break;
+				break;
+		}
 	}
+
+	ast_walk_free(&walk);
+}
+
+
+static void import_modules(const module_list_t* imports)
+{
+	for(size_t i = 0; imports && i < imports->module_cnt; i++)
+		for(size_t j = 0; j < imports->modules[i].export_cnt; j++)
+			import_function(&imports->modules[i].exports[j]);
 }
 
+static void translate_data(buf_writer_t* writer)
+{
+	bufncpy(writer, "; data");
+	
+	for(size_t i = 0; i < identifier_cnt; i++)
+	{
+		if(identifiers[i].type != TYPE_VARIABLE) continue;
+		bufcpy(writer, identifiers[i].value.variable.label);
+		bufncpy(writer, ":");
+		bufncpy(writer, "\t dq 0");
+	}
+}
 
-buf_writer_t translate(ASTNode* ast)
+// The imported modules were translated when they were compiled, their
+// assembly is appended as is
+buf_writer_t translate(const ast_t* ast, const module_list_t* imports)
 {
 	buf_writer_t writer = { writer.buf = (char*)calloc(DEFAULT_ASM_ALLOC, sizeof(char)), .buf_len = DEFAULT_ASM_ALLOC};
 
+	import_modules(imports);
+
 	bufncpy(&writer, "call main");
 	bufncpy(&writer, "hlt");
 
-	translate_recursive(&writer, ast);
+	translate_ast(&writer, ast);
 
-	bufncpy(&writer, "; data");
-	
-	for(int i = 0; i < identifier_cnt; i++)
+	translate_data(&writer);
+
+	for(size_t i = 0; imports && i < imports->module_cnt; i++)
 	{
-		if(identifiers[i].type != TYPE_VARIABLE) continue;
-		bufcpy(&writer, identifiers[i].value.variable.label);
-		bufncpy(&writer, ":");
-		bufncpy(&writer, "\t dq 0");
+		bufcpy(&writer, "; module ");
+		bufncpy(&writer, imports->modules[i].path);
+		bufcpy(&writer, imports->modules[i].code);
 	}
 
 	bufend(&writer);
@@ -410,3 +497,30 @@ buf_writer_t translate(ASTNode* ast)
 
 	return writer;
 }
+
+// Translates a module without an entry point. Every function it defines,
+// main excluded, is exported; the assembly is stored in the interface.
+void translate_module(const ast_t* ast, const module_list_t* imports, const char* prefix, module_interface_t* module)
+{
+	buf_writer_t writer = { writer.buf = (char*)calloc(DEFAULT_ASM_ALLOC, sizeof(char)), .buf_len = DEFAULT_ASM_ALLOC};
+
+	import_modules(imports);
+	label_prefix = prefix;
+
+	translate_ast(&writer, ast);
+
+	translate_data(&writer);
+	bufend(&writer);
+
+	for(size_t i = 0; i < identifier_cnt; i++)
+	{
+		if(identifiers[i].type != TYPE_FUNCTION || identifiers[i].value.function.imported || identifiers[i].name == entrypoint_symbol())
+			continue;
+		module_add_export(module, symbol_name(identifiers[i].name), identifiers[i].value.function.arg_cnt, identifiers[i].value.function.label);
+	}
+
+	module->code = writer.buf;
+
+	free_identifiers();
+	label_prefix = "";
+}
@@ -3,7 +3,9 @@
 #include <stdlib.h>
 #include "parser.h"
 #include "buffer.h"
+#include "module.h"
 
 static const size_t DEFAULT_ASM_ALLOC = 256;
 
-buf_writer_t translate(ASTNode* ast);
+buf_writer_t translate(const ast_t* ast, const module_list_t* imports);
+void translate_module(const ast_t* ast, const module_list_t* imports, const char* prefix, module_interface_t* module);
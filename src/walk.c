@@ -0,0 +1,22 @@
+#include <stdlib.h>
+
+#include "walk.h"
+
+void ast_walk_init(ast_walk_t* walk, const ast_t* ast, ast_index_t root)
+{
+	*walk = (ast_walk_t){ .ast = ast };
+	if (root)
+		ast_walk_push(walk, root);
+}
+
+void ast_walk_grow(ast_walk_t* walk)
+{
+	walk->frames_allocated = walk->frames_allocated ? walk->frames_allocated * 2 : DEFAULT_WALK_DEPTH_ALLOC;
+	walk->frames = (ast_walk_frame_t*)realloc(walk->frames, walk->frames_allocated * sizeof(ast_walk_frame_t));
+}
+
+void ast_walk_free(ast_walk_t* walk)
+{
+	free(walk->frames);
+	*walk = (ast_walk_t){0};
+}
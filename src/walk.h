@@ -0,0 +1,165 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "ast.h"
+
+static const size_t DEFAULT_WALK_DEPTH_ALLOC = 64;
+
+// Depth-first AST walk on an explicit stack, the nesting depth is bounded
+// by the heap only. Every node is handed to the pass once before each of
+// its children and once after the last: step 0 is the pre-order visit,
+// step == child_cnt the post-order one and the steps in between come after
+// child step - 1, for passes that emit something between two children.
+// Missing children (no else branch, no initializer) still get their step.
+//
+//	ast_walk_t walk = {0};
+//	ast_walk_init(&walk, &ast, ast.root);
+//	while (ast_walk_next(&walk))
+//	{
+//		ast_walk_frame_t* frame = ast_walk_top(&walk);
+//		... switch on frame->node->type and frame->step
+//	}
+//	ast_walk_free(&walk);
+//
+// The stepping is inline, a walk costs no function call per node.
+
+typedef struct ast_walk_frame
+{
+	const ast_node_t* node;
+	size_t step;		// children visited so far
+	size_t child_cnt;
+	void* locals[2];	// kept for the pass between the steps of one node
+} ast_walk_frame_t;
+
+typedef struct ast_walk
+{
+	const ast_t* ast;
+	ast_walk_frame_t* frames;
+	size_t depth;
+	size_t frames_allocated;
+	bool started;
+	bool skip;
+} ast_walk_t;
+
+void ast_walk_init(ast_walk_t* walk, const ast_t* ast, ast_index_t root);
+void ast_walk_grow(ast_walk_t* walk);
+void ast_walk_free(ast_walk_t* walk);
+
+// Child order: parameters or arguments, then the body; condition, then
+// branches; left before right. Names are symbols, not children.
+static inline size_t ast_child_cnt(const ast_t* ast, const ast_node_t* node)
+{
+	switch (node->type)
+	{
+		case AST_WHILE:
+		case AST_BINARY:
+			return 2;
+		case AST_IF:
+			return 3;
+		case AST_ASSIGNMENT:
+		case AST_DECLARATION:
+		case AST_RETURN:
+			return 1;
+		case AST_FUNCTION:
+			return ast_list_cnt(ast, node->data.function.parameters) + 1;
+		case AST_FUNCTION_CALL:
+			return ast_list_cnt(ast, node->data.function_call.arguments);
+		case AST_BLOCK:
+		case AST_PROGRAM:
+			return ast_list_cnt(ast, node->data.block.children);
+		default:
+			return 0;
+	}
+}
+
+static inline ast_index_t ast_child(const ast_t* ast, const ast_node_t* node, size_t i)
+{
+	switch (node->type)
+	{
+		case AST_ASSIGNMENT:
+			return node->data.assignment.value;
+		case AST_DECLARATION:
+			return node->data.declaration.initializer;
+		case AST_RETURN:
+			return node->data.return_statement.value;
+		case AST_WHILE:
+			return i ? node->data.while_statement.body : node->data.while_statement.condition;
+		case AST_BINARY:
+			return i ? node->data.binary_op.right : node->data.binary_op.left;
+		case AST_IF:
+			return i == 0 ? node->data.if_statement.condition
+				: i == 1 ? node->data.if_statement.then_branch : node->data.if_statement.else_branch;
+		case AST_FUNCTION:
+			if (i < ast_list_cnt(ast, node->data.function.parameters))
+				return ast_list_items(ast, node->data.function.parameters)[i];
+			return node->data.function.body;
+		case AST_FUNCTION_CALL:
+			return ast_list_items(ast, node->data.function_call.arguments)[i];
+		case AST_BLOCK:
+		case AST_PROGRAM:
+			return ast_list_items(ast, node->data.block.children)[i];
+		default:
+			return 0;
+	}
+}
+
+static inline ast_walk_frame_t* ast_walk_top(ast_walk_t* walk)
+{
+	return &walk->frames[walk->depth - 1];
+}
+
+// The frame the current node was reached from, 0 at the root. Its step is
+// the index of the current node among its children.
+static inline ast_walk_frame_t* ast_walk_parent(ast_walk_t* walk)
+{
+	return walk->depth > 1 ? &walk->frames[walk->depth - 2] : 0;
+}
+
+// Leaves out the child that would be entered after the current step, the
+// node gets its next step right away
+static inline void ast_walk_skip(ast_walk_t* walk)
+{
+	walk->skip = true;
+}
+
+static inline void ast_walk_push(ast_walk_t* walk, ast_index_t index)
+{
+	if (walk->depth == walk->frames_allocated)
+		ast_walk_grow(walk);
+
+	const ast_node_t* node = ast_node(walk->ast, index);
+	walk->frames[walk->depth++] = (ast_walk_frame_t){ .node = node, .child_cnt = ast_child_cnt(walk->ast, node) };
+}
+
+// Moves to the next step, false once the root has had its last one
+static inline bool ast_walk_next(ast_walk_t* walk)
+{
+	if (!walk->started)
+	{
+		walk->started = true;
+		return walk->depth != 0;
+	}
+
+	ast_walk_frame_t* top = ast_walk_top(walk);
+	bool skip = walk->skip;
+	walk->skip = false;
+
+	if (top->step == top->child_cnt)
+	{
+		if (!--walk->depth)
+			return false;
+
+		ast_walk_top(walk)->step++;
+		return true;
+	}
+
+	ast_index_t child = skip ? 0 : ast_child(walk->ast, top->node, top->step);
+	if (child)
+		ast_walk_push(walk, child);
+	else
+		top->step++;
+
+	return true;
+}